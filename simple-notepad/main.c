@@ -19,29 +19,123 @@
  */
 
 #include <gtk/gtk.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "filehandler.h"
+#include "file_batch.h"
+#include "file_loader.h"
+#include "io_engine.h"
+#include "long_lines.h"
 #include "message_dialogs.h"
+#include "session.h"
+#include "text_snapshot.h"
+#include "undo_history.h"
 
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
 
 #define GETTEXT_PACKAGE "simple-notepad"
 #define LOCALEDIR "mo"
 
+#ifdef HAVE_GRESOURCE
+#if !GLIB_CHECK_VERSION(2,32,0)
+#error "Embedded interface (HAVE_GRESOURCE) needs GLib >= 2.32"
+#endif
+// Where simple-notepad.gresource.xml puts the interface
+#define UI_RESOURCE "/org/gtkfilehandler/simple-notepad/simple-notepad.ui"
+#endif
+
 struct GUI_widgets
 {
 	GtkWidget *main_window;
 	GtkWidget *textview;
 	GtkWidget *statusbar;
 	Filehandler *fh;
+	UndoHistory *history;
+	TextMirror *mirror;
+
+	// Contents already read by file loader, used by next notepad_open()
+	gchar *preloaded;
+	gsize preloaded_length;
+	IoEngineFileId preloaded_id;
+
+	// Document restored from session, not loaded until window gets focus
+	gchar *pending_filename;
+	gint pending_cursor;
+	gint pending_top;
+
+	// Last closed document, and where the user was on it
+	gchar *closed_filename;
+	gint closed_cursor;
+	gint closed_top;
+
+	// Where the user was on the document when it was hibernated
+	gint hibernated_cursor;
+	gint hibernated_top;
+
+	// Shows long lines cut short, read-only
+	GtkToggleAction *preview;
 };
 
+// Every opened window
+static GList *windows = NULL;
+
+// Documents of windows closed by a quit the user gave up, and last
+//   directory: they go to the session written by next quit
+static Session *session = NULL;
+// While quitting: windows being closed, first one is where quit started,
+//   and their documents (SessionDocument), taken before closing any
+static GList *quit_windows = NULL;
+static GArray *quit_documents = NULL;
+
+// Saves of a replay are written here, never to the files of the trace
+static gchar *replay_scratch = NULL;
+
+// When the program was started, for the startup benchmark; 0 if not timed
+static gint64 startup_time = 0;
+
 // Filehandler callbacks
 static void notepad_new(gpointer data);
 static gboolean notepad_open(const gchar *filename, gpointer data);
 static gboolean notepad_save(gpointer data);
 static gboolean notepad_save_as(const gchar *filename, gpointer data);
 static void notepad_close(gpointer data);
+static void notepad_open_many(const gchar * const *filenames, gpointer data);
+static void notepad_quit(gpointer data);
+static gpointer notepad_snapshot(gpointer data);
+static gboolean notepad_save_snapshot(gpointer snapshot, const gchar *filename, GError **error);
+static void notepad_snapshot_done(gpointer snapshot, gboolean written, gpointer data);
+static void notepad_free_snapshot(gpointer snapshot);
+static gboolean notepad_hibernate(const gchar *spill_filename, gpointer data);
+static gboolean notepad_wake(const gchar *filename, gpointer data);
+static gchar *notepad_contents(gsize *length, gpointer data);
+
+static gboolean on_main_window_focus_in_event(GtkWidget *widget,
+		GdkEventFocus *event, gpointer data);
+
+// The interface definition, read once for all windows
+//   When built with HAVE_GRESOURCE, it's embedded in the executable and
+//   isn't copied; otherwise it's read from working directory.
+static const gchar *get_ui_definition(gsize *length, GError **error)
+{
+#ifdef HAVE_GRESOURCE
+	static GBytes *definition = NULL;
+	if (definition == NULL)
+		definition = g_resources_lookup_data(UI_RESOURCE, G_RESOURCE_LOOKUP_FLAGS_NONE, error);
+	if (definition == NULL)
+		return NULL;
+	return g_bytes_get_data(definition, length);
+#else
+	static gchar *definition = NULL;
+	static gsize definition_length = 0;
+	if (definition == NULL &&
+			!g_file_get_contents("simple-notepad.ui", &definition, &definition_length, error))
+		return NULL;
+	*length = definition_length;
+	return definition;
+#endif
+}
 
 // Load GUI stuff
 static gboolean load_gui(Filehandler *fh, struct GUI_widgets *widgets)
@@ -53,7 +147,10 @@ static gboolean load_gui(Filehandler *fh, struct GUI_widgets *widgets)
 	if (builder == NULL)
 		return FALSE;
 
-	gtk_builder_add_from_file(builder, "simple-notepad.ui", &err);
+	gsize length;
+	const gchar *definition = get_ui_definition(&length, &err);
+	if (definition != NULL)
+		gtk_builder_add_from_string(builder, definition, length, &err);
 	if (err != NULL)
 	{
 		g_error_free(err);
@@ -78,29 +175,60 @@ static gboolean load_gui(Filehandler *fh, struct GUI_widgets *widgets)
 	fh->actions.save = GTK_ACTION(gtk_builder_get_object(builder, "action_save"));
 	fh->actions.save_as = GTK_ACTION(gtk_builder_get_object(builder, "action_save_as"));
 	fh->actions.close = GTK_ACTION(gtk_builder_get_object(builder, "action_close"));
+	widgets->preview = GTK_TOGGLE_ACTION(gtk_builder_get_object(builder, "action_preview"));
 
-	g_object_unref(builder);
+	// Messages go below the menu, without blocking the window
+	setNotificationArea(GTK_WINDOW(widgets->main_window),
+			GTK_WIDGET(gtk_builder_get_object(builder, "vbox1")), 1);
 
+	widgets->history = undo_history_new(gtk_text_view_get_buffer(GTK_TEXT_VIEW(widgets->textview)), fh);
+	undo_history_set_actions(widgets->history,
+			GTK_ACTION(gtk_builder_get_object(builder, "action_undo")),
+			GTK_ACTION(gtk_builder_get_object(builder, "action_redo")));
+	widgets->mirror = text_mirror_new(gtk_text_view_get_buffer(GTK_TEXT_VIEW(widgets->textview)));
+	text_mirror_track_changes(widgets->mirror);
 
-	gtk_window_set_icon_name(GTK_WINDOW(widgets->main_window), GTK_STOCK_JUSTIFY_LEFT);
+	g_object_unref(builder);
 
 	return TRUE;
 }
 
-int main(int argc, char *argv[])
+// Icon for every window, looked up in icon theme after first frame is shown
+static gboolean set_default_icon(gpointer data)
 {
-	Filehandler *fh;
-	FilehandlerCallbacks cb;
-	struct GUI_widgets widgets;
-	
-	// Internationalization stuff
-	bindtextdomain (GETTEXT_PACKAGE, LOCALEDIR);
-	bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");	
-	textdomain (GETTEXT_PACKAGE);
-	
-	// Initialize GTK
-	gtk_init(&argc, &argv);
-	
+	gtk_window_set_default_icon_name(GTK_STOCK_JUSTIFY_LEFT);
+	return FALSE;
+}
+
+// Microseconds since epoch by wall clock, the one a shell can read too
+static gint64 get_real_time(void)
+{
+#if GLIB_CHECK_VERSION(2,28,0)
+	return g_get_real_time();
+#else
+	GTimeVal now;
+	g_get_current_time(&now);
+	return (gint64) now.tv_sec * G_USEC_PER_SEC + now.tv_usec;
+#endif
+}
+
+// Startup benchmark: print how long the first frame took to be drawn, then quit
+//   It's timed from when the program was run, so loading libraries counts.
+static gboolean on_first_frame(GtkWidget *widget, gpointer event, gpointer data)
+{
+	g_print("%" G_GINT64_FORMAT "\n", get_real_time() - startup_time);
+
+	g_signal_handlers_disconnect_by_func(widget, on_first_frame, data);
+	gtk_main_quit();
+	return FALSE;
+}
+
+// Create a new window, with its own Filehandler
+static struct GUI_widgets *notepad_window_new(void)
+{
+	FilehandlerCallbacks cb = { 0 };
+	struct GUI_widgets *widgets = g_new0(struct GUI_widgets, 1);
+
 	// Create the document file handler callbacks
 	cb.new = notepad_new;
 	cb.open = notepad_open;
@@ -108,41 +236,701 @@ int main(int argc, char *argv[])
 	cb.save_as = notepad_save_as;
 	cb.close = notepad_close;
 	cb.include_in_recents = NULL;
+	cb.open_many = notepad_open_many;
+	cb.quit = notepad_quit;
+	cb.snapshot = notepad_snapshot;
+	cb.save_snapshot = notepad_save_snapshot;
+	cb.snapshot_done = notepad_snapshot_done;
+	cb.free_snapshot = notepad_free_snapshot;
+	cb.hibernate = notepad_hibernate;
+	cb.wake = notepad_wake;
+	cb.contents = notepad_contents;
 
 	// Create the document file handler
-	fh = filehandler_new(&cb, NULL, &widgets);
-	if (fh == NULL)
+	widgets->fh = filehandler_new(&cb, NULL, widgets);
+	if (widgets->fh == NULL)
 	{
 		showErrorMessage(NULL, _("Couldn't allocate memory!"));
-		return 1;
+		g_free(widgets);
+		return NULL;
 	}
 
 	// Load GUI
-	if (!load_gui(fh, &widgets))
+	if (!load_gui(widgets->fh, widgets))
 	{
 		showErrorMessage(NULL, _("Couldn't open the window!"));
-		filehandler_destroy(fh);
+		filehandler_destroy(widgets->fh);
+		g_free(widgets);
+		return NULL;
+	}
+
+	widgets->fh->main_window = widgets->main_window;
+	filehandler_update_action_status(widgets->fh);
+
+	g_signal_connect(widgets->main_window, "focus-in-event",
+			G_CALLBACK(on_main_window_focus_in_event), widgets);
+
+	windows = g_list_append(windows, widgets);
+	return widgets;
+}
+
+// Where the user is in the document: cursor and top of the view
+static void get_view_position(struct GUI_widgets *widgets, gint *cursor, gint *top)
+{
+	GtkTextView *view = GTK_TEXT_VIEW(widgets->textview);
+	GtkTextBuffer *buffer = gtk_text_view_get_buffer(view);
+	GtkTextIter iter;
+	GdkRectangle rect;
+
+	gtk_text_buffer_get_iter_at_mark(buffer, &iter, gtk_text_buffer_get_insert(buffer));
+	*cursor = gtk_text_iter_get_offset(&iter);
+
+	gtk_text_view_get_visible_rect(view, &rect);
+	gtk_text_view_get_iter_at_location(view, &iter, rect.x, rect.y);
+	*top = gtk_text_iter_get_offset(&iter);
+}
+
+// Document of a window as a session remembers it
+//   filename is NULL if it has none. Free it with g_free().
+static void get_session_document(struct GUI_widgets *widgets, SessionDocument *doc)
+{
+	const gchar *filename = filehandler_get_filename(widgets->fh);
+
+	doc->filename = NULL;
+	doc->cursor = 0;
+	doc->top = 0;
+	if (widgets->pending_filename != NULL)
+	{
+		doc->filename = g_strdup(widgets->pending_filename);
+		doc->cursor = widgets->pending_cursor;
+		doc->top = widgets->pending_top;
+	}
+	else if (filename != NULL && *filename != '\0')
+	{
+		doc->filename = g_strdup(filename);
+		if (filehandler_is_hibernated(widgets->fh))
+		{
+			doc->cursor = widgets->hibernated_cursor;
+			doc->top = widgets->hibernated_top;
+		}
+		else
+			get_view_position(widgets, &doc->cursor, &doc->top);
+	}
+}
+
+static void set_view_position(struct GUI_widgets *widgets, gint cursor, gint top)
+{
+	GtkTextView *view = GTK_TEXT_VIEW(widgets->textview);
+	GtkTextBuffer *buffer = gtk_text_view_get_buffer(view);
+	GtkTextIter iter;
+
+	gtk_text_buffer_get_iter_at_offset(buffer, &iter, cursor);
+	gtk_text_buffer_place_cursor(buffer, &iter);
+
+	// Scrolling to a mark works even if text isn't laid out yet
+	gtk_text_buffer_get_iter_at_offset(buffer, &iter, top);
+	GtkTextMark *mark = gtk_text_buffer_get_mark(buffer, "notepad-top");
+	if (mark == NULL)
+		mark = gtk_text_buffer_create_mark(buffer, "notepad-top", &iter, TRUE);
+	else
+		gtk_text_buffer_move_mark(buffer, mark, &iter);
+	gtk_text_view_scroll_to_mark(view, mark, 0.0, TRUE, 0.0, 0.0);
+}
+
+// Load the document this window is holding a place for, if any
+static void load_pending_document(struct GUI_widgets *widgets)
+{
+	gchar *filename = widgets->pending_filename;
+	if (filename == NULL)
+		return;
+	widgets->pending_filename = NULL;
+
+	gtk_window_set_title(GTK_WINDOW(widgets->main_window), _("Simple Notepad"));
+	if (filehandler_open_file(widgets->fh, filename))
+		set_view_position(widgets, widgets->pending_cursor, widgets->pending_top);
+	g_free(filename);
+}
+
+static gboolean on_main_window_focus_in_event(GtkWidget *widget,
+		GdkEventFocus *event, gpointer data)
+{
+	struct GUI_widgets *widgets = data;
+
+	load_pending_document(widgets);
+	filehandler_touch(widgets->fh);
+	return FALSE;
+}
+
+static gboolean load_pending_document_idle(gpointer data)
+{
+	if (g_list_find(windows, data) != NULL)
+		load_pending_document(data);
+	return FALSE;
+}
+
+// Make a window hold a place for a document of the session
+static void set_pending_document(struct GUI_widgets *widgets, const SessionDocument *doc)
+{
+	g_free(widgets->pending_filename);
+	widgets->pending_filename = g_strdup(doc->filename);
+	widgets->pending_cursor = doc->cursor;
+	widgets->pending_top = doc->top;
+
+	gchar *basename = g_path_get_basename(doc->filename);
+	gtk_window_set_title(GTK_WINDOW(widgets->main_window), basename);
+	g_free(basename);
+}
+
+// Documents of restored session still without a window
+struct SessionRestore
+{
+	Session *session;
+	guint next;
+};
+
+// Create one placeholder window per main loop iteration,
+//   so startup doesn't wait for the whole session
+static gboolean restore_next_document(gpointer data)
+{
+	struct SessionRestore *restore = data;
+	Session *restored = restore->session;
+
+	while (restore->next < restored->documents->len)
+	{
+		guint n = restore->next++;
+		if ((gint) n == restored->active)
+			continue;
+
+		struct GUI_widgets *widgets = notepad_window_new();
+		if (widgets == NULL)
+			break;
+		filehandler_set_directory(widgets->fh, restored->last_dir);
+		set_pending_document(widgets, &g_array_index(restored->documents, SessionDocument, n));
+		gtk_window_set_focus_on_map(GTK_WINDOW(widgets->main_window), FALSE);
+		gtk_widget_show_all(widgets->main_window);
+		return TRUE;
+	}
+
+	session_free(restored);
+	g_free(restore);
+	return FALSE;
+}
+
+// Restore documents of last session
+//   Only the active one is read now; others are read when first focused.
+static void restore_session(struct GUI_widgets *widgets)
+{
+	gchar *path = session_get_default_path();
+	Session *restored = session_load(path, NULL);
+	g_free(path);
+	if (restored == NULL)
+		return;
+
+	filehandler_set_directory(widgets->fh, restored->last_dir);
+	if (restored->active >= 0)
+	{
+		set_pending_document(widgets, &g_array_index(restored->documents,
+				SessionDocument, restored->active));
+		g_idle_add(load_pending_document_idle, widgets);
+	}
+
+	struct SessionRestore *restore = g_new0(struct SessionRestore, 1);
+	restore->session = restored;
+	g_idle_add_full(G_PRIORITY_LOW, restore_next_document, restore, NULL);
+}
+
+// A batch of files being opened
+struct OpenBatch
+{
+	// The window to be used by the first file read, if it's still empty
+	struct GUI_widgets *reuse;
+};
+
+// Called as soon as each file of a batch has been read
+static void on_file_loaded(const gchar *filename, gchar *contents, gsize length,
+		const IoEngineFileId *id, const GError *error, gpointer data)
+{
+	struct OpenBatch *batch = data;
+	struct GUI_widgets *widgets = NULL;
+
+	// Has the window been closed meanwhile?
+	if (batch->reuse != NULL && g_list_find(windows, batch->reuse) == NULL)
+		batch->reuse = NULL;
+
+	if (contents == NULL)
+	{
+		struct GUI_widgets *parent = batch->reuse;
+		if (parent == NULL && windows != NULL)
+			parent = windows->data;
+		showErrorMessage(parent != NULL ? GTK_WINDOW(parent->main_window) : NULL,
+				error->message);
+		return;
+	}
+
+	if (batch->reuse != NULL && filehandler_get_filename(batch->reuse->fh) == NULL)
+		widgets = batch->reuse;
+	else
+		widgets = notepad_window_new();
+	batch->reuse = NULL;
+
+	if (widgets == NULL)
+	{
+		g_free(contents);
+		return;
+	}
+
+	widgets->preloaded = contents;
+	widgets->preloaded_length = length;
+	widgets->preloaded_id = *id;
+	filehandler_open_file(widgets->fh, filename);
+	// If it wasn't opened, drop it
+	g_free(widgets->preloaded);
+	widgets->preloaded = NULL;
+
+	gtk_widget_show_all(widgets->main_window);
+}
+
+static void on_files_loaded(gpointer data)
+{
+	g_free(data);
+}
+
+// Open several files, each one in its own window.
+//   They're read in parallel; reuse window gets the first one ready.
+static void notepad_open_files(const gchar * const *filenames, struct GUI_widgets *reuse)
+{
+	struct OpenBatch *batch = g_new0(struct OpenBatch, 1);
+	batch->reuse = reuse;
+	file_loader_read_files(filenames, 0, on_file_loaded, on_files_loaded, batch);
+}
+
+// Replay report: how long each callback took when recorded and now
+struct ReplayReport
+{
+	guint steps;
+	guint diverged;
+	guint64 recorded;
+	guint64 replayed;
+	GMainLoop *loop;
+};
+
+// A document of a replay: just its text, without window, so no display is
+//   needed. Timings are of Filehandler and file reads and writes; those of
+//   the text view are left out.
+struct ReplayDocument
+{
+	Filehandler *fh;
+	GString *text;
+};
+
+static GList *replay_documents = NULL;
+
+static void replay_document_new_file(gpointer data)
+{
+	struct ReplayDocument *doc = data;
+	g_string_truncate(doc->text, 0);
+}
+
+static gboolean replay_document_open(const gchar *filename, gpointer data)
+{
+	struct ReplayDocument *doc = data;
+	GError *error = NULL;
+	gchar *contents;
+	gsize length;
+
+	if (!file_loader_read_file(filename, &contents, &length, NULL, &error))
+	{
+		g_printerr("%s\n", error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+	g_string_truncate(doc->text, 0);
+	g_string_append_len(doc->text, contents, length);
+	g_free(contents);
+	return TRUE;
+}
+
+// Text is written as it would be, but to the scratch file
+static gboolean replay_document_save_as(const gchar *filename, gpointer data)
+{
+	struct ReplayDocument *doc = data;
+	GError *error = NULL;
+
+	if (!io_engine_write_file(replay_scratch, doc->text->str, doc->text->len, &error))
+	{
+		g_printerr("%s\n", error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static gboolean replay_document_save(gpointer data)
+{
+	struct ReplayDocument *doc = data;
+	return replay_document_save_as(filehandler_get_filename(doc->fh), data);
+}
+
+static void replay_document_free(struct ReplayDocument *doc)
+{
+	replay_documents = g_list_remove(replay_documents, doc);
+	filehandler_destroy(doc->fh);
+	g_string_free(doc->text, TRUE);
+	g_free(doc);
+}
+
+// Free it when main loop is idle, as Filehandler may still be running
+static gboolean replay_document_free_idle(gpointer data)
+{
+	replay_document_free(data);
+	return FALSE;
+}
+
+static void replay_document_quit(gpointer data)
+{
+	g_idle_add(replay_document_free_idle, data);
+}
+
+static Filehandler *replay_new_document(gpointer data)
+{
+	FilehandlerCallbacks cb = { 0 };
+	struct ReplayDocument *doc = g_new0(struct ReplayDocument, 1);
+
+	cb.new = replay_document_new_file;
+	cb.open = replay_document_open;
+	cb.save = replay_document_save;
+	cb.save_as = replay_document_save_as;
+	cb.close = replay_document_new_file;
+	cb.quit = replay_document_quit;
+
+	doc->fh = filehandler_new(&cb, NULL, doc);
+	doc->text = g_string_new(NULL);
+	replay_documents = g_list_append(replay_documents, doc);
+	return doc->fh;
+}
+
+static void replay_step(const ActionTraceEvent *recorded, const ActionTraceEvent *replayed,
+		gpointer data)
+{
+	struct ReplayReport *report = data;
+
+	if (recorded == NULL && replayed == NULL)
+	{
+		report->diverged++;
+		g_print(_("Replay went otherwise: prompt or file dialog cancelled\n"));
+		return;
+	}
+	if (replayed == NULL)
+	{
+		report->diverged++;
+		if (recorded->kind == ACTION_TRACE_ACTION)
+			g_print(_("Document %u: couldn't replay %s\n"), recorded->document,
+					action_trace_get_action_name(recorded->code));
+		else if (recorded->kind == ACTION_TRACE_CALLBACK)
+			g_print(_("Document %u: %s didn't happen\n"), recorded->document,
+					action_trace_get_callback_name(recorded->code));
+		else
+			g_print(_("Document %u: answer not asked for\n"), recorded->document);
+		return;
+	}
+	if (recorded == NULL)
+	{
+		report->diverged++;
+		g_print(_("Document %u: %-13s %10s %10.3f ms (not in trace)\n"), replayed->document,
+				action_trace_get_callback_name(replayed->code), "",
+				replayed->duration / 1000.0);
+		return;
+	}
+
+	report->steps++;
+	report->recorded += recorded->duration;
+	report->replayed += replayed->duration;
+	g_print(_("Document %u: %-13s %10.3f ms %10.3f ms\n"), replayed->document,
+			action_trace_get_callback_name(replayed->code),
+			recorded->duration / 1000.0, replayed->duration / 1000.0);
+}
+
+static void replay_done(gpointer data)
+{
+	struct ReplayReport *report = data;
+
+	g_print(_("%u steps: %.3f ms recorded, %.3f ms replayed; %u diverged\n"),
+			report->steps, report->recorded / 1000.0, report->replayed / 1000.0,
+			report->diverged);
+	g_main_loop_quit(report->loop);
+}
+
+// Replay a trace without display
+//   files are those the trace was recorded with, each opened in a document
+//   numbered as its window was.
+static int run_replay(const gchar *trace_filename, int argc, char *argv[])
+{
+	GError *error = NULL;
+	ActionTrace *trace = action_trace_load(trace_filename, &error);
+	if (trace == NULL)
+	{
+		g_printerr("%s\n", error->message);
+		g_error_free(error);
+		return 1;
+	}
+
+	// Saves take as long as they would, but files of the trace are kept
+	gint fd = g_file_open_tmp("simple-notepad-replay-XXXXXX", &replay_scratch, &error);
+	if (fd < 0)
+	{
+		g_printerr("%s\n", error->message);
+		g_error_free(error);
+		action_trace_free(trace);
+		return 1;
+	}
+	close(fd);
+
+#if !GLIB_CHECK_VERSION(2,36,0)
+	g_type_init();
+#endif
+
+	int n;
+	Filehandler *fh = replay_new_document(NULL);
+	for (n = 1; n < argc; n++)
+	{
+		if (n > 1)
+			fh = replay_new_document(NULL);
+		filehandler_open_file(fh, argv[n]);
+	}
+
+	struct ReplayReport report = { 0, 0, 0, 0, g_main_loop_new(NULL, FALSE) };
+	FilehandlerReplayCallbacks replay_cb = { replay_new_document, replay_step, replay_done };
+	filehandler_replay_trace(trace, &replay_cb, &report);
+	g_main_loop_run(report.loop);
+	g_main_loop_unref(report.loop);
+
+	while (g_main_context_iteration(NULL, FALSE))
+		;
+	while (replay_documents != NULL)
+		replay_document_free(replay_documents->data);
+
+	g_unlink(replay_scratch);
+	g_free(replay_scratch);
+	return 0;
+}
+
+// Batch transform: make every line end with eol (data)
+static gboolean normalize_line_endings(gchar **contents, gsize *length, gpointer data)
+{
+	const gchar *eol = data;
+	gsize eol_length = strlen(eol);
+	const gchar *p = *contents;
+	const gchar *end = p + *length;
+	GString *out = g_string_sized_new(*length + 1);
+
+	while (p < end)
+	{
+		const gchar *q = p;
+		while (q < end && *q != '\n' && *q != '\r')
+			q++;
+		g_string_append_len(out, p, q - p);
+		if (q == end)
+			break;
+		g_string_append_len(out, eol, eol_length);
+		p = q + (*q == '\r' && q + 1 < end && q[1] == '\n' ? 2 : 1);
+	}
+
+	if (out->len == *length && memcmp(out->str, *contents, *length) == 0)
+	{
+		g_string_free(out, TRUE);
+		return FALSE;
+	}
+	g_free(*contents);
+	*length = out->len;
+	*contents = g_string_free(out, FALSE);
+	return TRUE;
+}
+
+// Files to process in batch: those given, or one per line from standard input
+static GPtrArray *get_batch_paths(int argc, char *argv[])
+{
+	GPtrArray *paths = g_ptr_array_new();
+	int n;
+	for (n = 1; n < argc; n++)
+		g_ptr_array_add(paths, g_strdup(argv[n]));
+
+	if (argc <= 1)
+	{
+		// Paths are bytes, in no encoding; lines may be as long as they are
+		GIOChannel *channel = g_io_channel_unix_new(0);
+		g_io_channel_set_encoding(channel, NULL, NULL);
+
+		gchar *line;
+		gsize terminator;
+		while (g_io_channel_read_line(channel, &line, NULL, &terminator, NULL)
+				== G_IO_STATUS_NORMAL)
+		{
+			line[terminator] = '\0';
+			if (*line != '\0')
+				g_ptr_array_add(paths, line);
+			else
+				g_free(line);
+		}
+		g_io_channel_unref(channel);
+	}
+	return paths;
+}
+
+// Open, transform and save files without any window, and tell how it went
+static int run_batch(int argc, char *argv[], gint jobs, const gchar *eol_name)
+{
+	const gchar *eol = NULL;
+	if (g_strcmp0(eol_name, "lf") == 0)
+		eol = "\n";
+	else if (g_strcmp0(eol_name, "crlf") == 0)
+		eol = "\r\n";
+	else if (g_strcmp0(eol_name, "cr") == 0)
+		eol = "\r";
+	else if (eol_name != NULL)
+	{
+		g_printerr(_("Unknown line ending \"%s\": use lf, crlf or cr\n"), eol_name);
+		return 1;
+	}
+
+	GPtrArray *paths = get_batch_paths(argc, argv);
+	FileBatchStats stats;
+	file_batch_run((const gchar * const *) paths->pdata, paths->len, jobs,
+			eol != NULL ? normalize_line_endings : NULL, (gpointer) eol, &stats);
+
+	guint n;
+	for (n = 0; n < stats.errors->len; n++)
+		g_printerr("%s\n", (const gchar *) g_ptr_array_index(stats.errors, n));
+
+	gdouble seconds = stats.seconds > 0 ? stats.seconds : 1e-6;
+	g_print(_("%u files in %.2f s (%.0f files/s, %.1f MiB/s): "
+			"%u written, %u unchanged, %u failed\n"),
+			stats.files, stats.seconds, stats.files / seconds,
+			stats.bytes / seconds / (1024 * 1024),
+			stats.written, stats.unchanged, stats.failed);
+
+	int status = stats.failed > 0 ? 1 : 0;
+	file_batch_stats_clear(&stats);
+	g_ptr_array_foreach(paths, (GFunc) g_free, NULL);
+	g_ptr_array_free(paths, TRUE);
+	return status;
+}
+
+int main(int argc, char *argv[])
+{
+	struct GUI_widgets *widgets;
+	gchar *record_filename = NULL;
+	gchar *replay_filename = NULL;
+	gboolean batch = FALSE;
+	gint jobs = 0;
+	gchar *eol = NULL;
+	GError *error = NULL;
+	
+	// Internationalization stuff
+	bindtextdomain (GETTEXT_PACKAGE, LOCALEDIR);
+	bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");	
+	textdomain (GETTEXT_PACKAGE);
+	
+	GOptionEntry entries[] = {
+		{ "record", 0, 0, G_OPTION_ARG_FILENAME, &record_filename,
+				N_("Record file actions to a trace"), N_("TRACE") },
+		{ "replay", 0, 0, G_OPTION_ARG_FILENAME, &replay_filename,
+				N_("Replay a trace without windows and report timings"), N_("TRACE") },
+		{ "time-startup", 0, 0, G_OPTION_ARG_INT64, &startup_time,
+				N_("Print how long first frame took to be drawn since START (microseconds since epoch, when program was run) and quit"), N_("START") },
+		{ "batch", 0, 0, G_OPTION_ARG_NONE, &batch,
+				N_("Convert files (or those listed in standard input) to UTF-8 without windows"), NULL },
+		{ "jobs", 'j', 0, G_OPTION_ARG_INT, &jobs,
+				N_("Files processed at once in batch (default: one per processor)"), N_("N") },
+		{ "eol", 0, 0, G_OPTION_ARG_STRING, &eol,
+				N_("Also make line endings lf, crlf or cr in batch"), N_("EOL") },
+		{ NULL }
+	};
+
+	// Options are parsed before GTK+ opens the display, as batch and replay
+	//   need none
+	GOptionContext *context = g_option_context_new(_("[FILE...]"));
+	g_option_context_add_main_entries(context, entries, GETTEXT_PACKAGE);
+	g_option_context_add_group(context, gtk_get_option_group(FALSE));
+	gboolean parsed = g_option_context_parse(context, &argc, &argv, &error);
+	g_option_context_free(context);
+	if (!parsed)
+	{
+		g_printerr("%s\n", error->message);
+		g_error_free(error);
+		return 1;
+	}
+
+	if (batch)
+	{
+		int status = run_batch(argc, argv, jobs, eol);
+		g_free(eol);
+		return status;
+	}
+
+	if (record_filename != NULL && !filehandler_record_trace(record_filename, &error))
+	{
+		g_printerr("%s\n", error->message);
+		g_error_free(error);
 		return 1;
 	}
+
+	if (replay_filename != NULL)
+	{
+		int status = run_replay(replay_filename, argc, argv);
+		filehandler_record_trace(NULL, NULL);
+		g_free(record_filename);
+		g_free(replay_filename);
+		return status;
+	}
+
+	// Initialize GTK
+	gtk_init(&argc, &argv);
 	
-	widgets.fh = fh;
+	widgets = notepad_window_new();
+	if (widgets == NULL)
+		return 1;
 
-	fh->main_window = widgets.main_window;
-	filehandler_update_action_status(fh);
+	if (startup_time != 0)
+	{
+#if GTK_CHECK_VERSION(3,0,0)
+		g_signal_connect_after(widgets->main_window, "draw", G_CALLBACK(on_first_frame), NULL);
+#else
+		g_signal_connect_after(widgets->main_window, "expose-event", G_CALLBACK(on_first_frame), NULL);
+#endif
+	}
 
 	// Display the window
-	gtk_widget_show_all(fh->main_window);
+	gtk_widget_show_all(widgets->main_window);
+	g_idle_add_full(G_PRIORITY_LOW, set_default_icon, NULL, NULL);
+
+	session = session_new();
+
+	// Files given in command line, or those of last session
+	if (argc > 1)
+		notepad_open_files((const gchar * const *) &argv[1], widgets);
+	else
+		restore_session(widgets);
 
 	// Start the GTK event loop
 	gtk_main();
 	
-	// Destroy the handler
-	filehandler_destroy(fh);
-	
+	filehandler_record_trace(NULL, NULL);
+	session_free(session);
+	g_free(record_filename);
+	g_free(replay_filename);
+	g_free(eol);
+
 	// Return 0 if exit is successful
 	return 0;
 }
 
+// Text is held by the buffer (with some overhead) and by its mirror
+static void update_memory_usage(struct GUI_widgets *widgets)
+{
+	filehandler_set_memory_usage(widgets->fh, 3 * text_mirror_get_length(widgets->mirror)
+			+ undo_history_get_size(widgets->history));
+}
+
 // Callback for document change
 //  As it is a GTK callback, data contains a Filehandler pointer
 //    since it was set by gtk_builder_connect_signals
@@ -150,8 +938,83 @@ G_MODULE_EXPORT
 void on_textbuffer1_changed(GtkTextBuffer *buffer, gpointer data)
 {
 	Filehandler *fh = data;
+	struct GUI_widgets *widgets = fh->user_data;
+
+	// A preview being shown or hidden isn't a change
+	if (text_mirror_is_frozen(widgets->mirror))
+		return;
 
 	filehandler_file_changed(fh, TRUE);
+	update_memory_usage(widgets);
+}
+
+// Text was just read from file
+//   Later saves may patch only what changes, unless the file wasn't in UTF-8
+//   (it was converted when read, so its bytes aren't those of the text).
+static void set_text_saved(struct GUI_widgets *widgets, const IoEngineFileId *file, gsize length)
+{
+	if (file->size == length)
+		text_mirror_set_saved(widgets->mirror, file);
+}
+
+// Put text in buffer, not undoable
+//   Long lines are shown split in segments, so they're laid out quickly.
+//   Returns TRUE if any was.
+static gboolean load_text(struct GUI_widgets *widgets, const gchar *contents, gsize length)
+{
+	GArray *breaks = long_lines_get_breaks(contents, length, LONG_LINES_LIMIT, LONG_LINES_SEGMENT);
+
+	undo_history_begin_not_undoable(widgets->history);
+	text_mirror_set_text(widgets->mirror, contents, length, breaks);
+	undo_history_end_not_undoable(widgets->history);
+
+	if (breaks == NULL)
+		return FALSE;
+	g_array_free(breaks, TRUE);
+	return TRUE;
+}
+
+// Show long lines cut short, without letting the user edit them
+//   Mirror keeps the whole text meanwhile, so it's what gets saved.
+static void start_preview(struct GUI_widgets *widgets)
+{
+	if (text_mirror_is_frozen(widgets->mirror))
+		return;
+
+	gsize length;
+	TextSnapshot *snapshot = text_mirror_snapshot(widgets->mirror);
+	gchar *contents = text_snapshot_flatten(snapshot, &length);
+	text_snapshot_free(snapshot);
+	gchar *preview = long_lines_truncate(contents, length, LONG_LINES_SEGMENT, &length);
+	g_free(contents);
+
+	text_mirror_freeze(widgets->mirror);
+	undo_history_begin_not_undoable(widgets->history);
+	gtk_text_buffer_set_text(gtk_text_view_get_buffer(GTK_TEXT_VIEW(widgets->textview)),
+			preview, length);
+	undo_history_end_not_undoable(widgets->history);
+	g_free(preview);
+
+	gtk_text_view_set_editable(GTK_TEXT_VIEW(widgets->textview), FALSE);
+	gtk_toggle_action_set_active(widgets->preview, TRUE);
+}
+
+// Back to the whole text
+static void stop_preview(struct GUI_widgets *widgets)
+{
+	if (!text_mirror_is_frozen(widgets->mirror))
+		return;
+
+	gsize length;
+	TextSnapshot *snapshot = text_mirror_snapshot(widgets->mirror);
+	gchar *contents = text_snapshot_flatten(snapshot, &length);
+	text_snapshot_free(snapshot);
+	load_text(widgets, contents, length);
+	g_free(contents);
+	text_mirror_thaw(widgets->mirror);
+
+	gtk_text_view_set_editable(GTK_TEXT_VIEW(widgets->textview), TRUE);
+	gtk_toggle_action_set_active(widgets->preview, FALSE);
 }
 
 // Filehandler callbacks
@@ -161,8 +1024,11 @@ static void notepad_new(gpointer data)
 {
 	struct GUI_widgets *widgets = data;
 	
+	stop_preview(widgets);
 	gtk_widget_set_sensitive(widgets->textview, TRUE);
+	undo_history_begin_not_undoable(widgets->history);
 	gtk_text_buffer_set_text(GTK_TEXT_BUFFER(gtk_text_view_get_buffer(GTK_TEXT_VIEW(widgets->textview))), "", -1);
+	undo_history_end_not_undoable(widgets->history);
 }
 
 static gboolean notepad_open(const gchar *filename, gpointer data)
@@ -172,21 +1038,33 @@ static gboolean notepad_open(const gchar *filename, gpointer data)
 	GError *error = NULL;
 	gchar *contents;
 	gsize length;
+	IoEngineFileId id;
 	
-	GtkTextBuffer *buffer;
-	
-	if (!g_file_get_contents(filename, &contents, &length, &error))
+	if (widgets->preloaded != NULL)
+	{
+		contents = widgets->preloaded;
+		length = widgets->preloaded_length;
+		id = widgets->preloaded_id;
+		widgets->preloaded = NULL;
+	}
+	else if (!file_loader_read_file(filename, &contents, &length, &id, &error))
 	{
 		showErrorMessage(GTK_WINDOW(widgets->main_window), error->message);
 		g_error_free(error);
 		return FALSE;
 	}
 	
-	buffer = GTK_TEXT_BUFFER(gtk_text_view_get_buffer(GTK_TEXT_VIEW(widgets->textview)));
-	gtk_text_buffer_set_text(buffer, contents, length);
+	stop_preview(widgets);
+	gboolean split = load_text(widgets, contents, length);
 	g_free(contents);
+	set_text_saved(widgets, &id, length);
 	
 	gtk_widget_set_sensitive(widgets->textview, TRUE);
+
+	if (split)
+		showNotification(GTK_WINDOW(widgets->main_window), GTK_MESSAGE_INFO,
+				_("Some lines are too long, so they're shown split. Splits aren't saved. "
+				"View > Truncated preview shows them cut short, faster but read-only."));
 	
 	return TRUE;
 }
@@ -204,19 +1082,14 @@ static gboolean notepad_save_as(const gchar *filename, gpointer data)
 	
 	GError *error = NULL;
 	gchar *contents;
-	
-	GtkTextBuffer *buffer;
-	
-	GtkTextIter start, end;
+	gsize length;
 
-	buffer = GTK_TEXT_BUFFER(gtk_text_view_get_buffer(GTK_TEXT_VIEW(widgets->textview)));
-	
-	gtk_text_buffer_get_start_iter(buffer, &start);
-	gtk_text_buffer_get_end_iter(buffer, &end);
+	// Mirror has the text without soft breaks, even while a preview is shown
+	TextSnapshot *snapshot = text_mirror_snapshot(widgets->mirror);
+	contents = text_snapshot_flatten(snapshot, &length);
+	text_snapshot_free(snapshot);
 	
-	contents = gtk_text_buffer_get_text(buffer, &start, &end, FALSE);
-	
-	if (!g_file_set_contents(filename, contents, -1, &error))
+	if (!io_engine_write_file(filename, contents, length, &error))
 	{
 		g_free(contents);
 		showErrorMessage(GTK_WINDOW(widgets->main_window), error->message);
@@ -225,14 +1098,381 @@ static gboolean notepad_save_as(const gchar *filename, gpointer data)
 	}
 	
 	g_free(contents);
+	undo_history_set_save_point(widgets->history);
+	IoEngineFileId id;
+	text_mirror_set_saved(widgets->mirror, io_engine_get_file_id(filename, &id) ? &id : NULL);
 	
 	return TRUE;
 }
 
+// Saving in background: the user can keep typing meanwhile
+static gpointer notepad_snapshot(gpointer data)
+{
+	struct GUI_widgets *widgets = data;
+
+	undo_history_begin_save(widgets->history);
+	return text_mirror_begin_save(widgets->mirror);
+}
+
+// Called from a worker thread
+//   Only changed bytes are written, if they're few and the file allows it.
+static gboolean notepad_save_snapshot(gpointer snapshot, const gchar *filename, GError **error)
+{
+	GArray *ranges;
+	gchar *data;
+	IoEngineFileId file;
+
+	if (text_snapshot_get_changes(snapshot, &ranges, &data, &file))
+	{
+		gboolean patched = io_engine_patch_file(filename, (IoEngineRange *) ranges->data,
+				ranges->len, &file, text_snapshot_get_length(snapshot), NULL);
+		g_array_free(ranges, TRUE);
+		g_free(data);
+		if (patched)
+		{
+			text_snapshot_set_written(snapshot, filename);
+			return TRUE;
+		}
+	}
+
+	gsize length;
+	gchar *contents = text_snapshot_flatten(snapshot, &length);
+
+	gboolean ok = io_engine_write_file(filename, contents, length, error);
+	g_free(contents);
+	if (ok)
+		text_snapshot_set_written(snapshot, filename);
+	return ok;
+}
+
+static void notepad_snapshot_done(gpointer snapshot, gboolean written, gpointer data)
+{
+	struct GUI_widgets *widgets = data;
+
+	undo_history_end_save(widgets->history, written);
+	text_mirror_end_save(widgets->mirror, snapshot, written);
+	text_snapshot_free(snapshot);
+}
+
+// Window was freed while its snapshot was being saved
+static void notepad_free_snapshot(gpointer snapshot)
+{
+	text_snapshot_free(snapshot);
+}
+
+// Drop the text (and its undo history) until window is used again
+static gboolean notepad_hibernate(const gchar *spill_filename, gpointer data)
+{
+	struct GUI_widgets *widgets = data;
+	GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(widgets->textview));
+
+	if (spill_filename != NULL)
+	{
+		GError *error = NULL;
+		gsize length;
+		TextSnapshot *snapshot = text_mirror_snapshot(widgets->mirror);
+		gchar *contents = text_snapshot_flatten(snapshot, &length);
+		text_snapshot_free(snapshot);
+
+		gboolean ok = io_engine_write_file(spill_filename, contents, length, &error);
+		g_free(contents);
+		if (!ok)
+		{
+			g_error_free(error);
+			return FALSE;
+		}
+	}
+
+	get_view_position(widgets, &widgets->hibernated_cursor, &widgets->hibernated_top);
+
+	// Dropping text isn't a change
+	stop_preview(widgets);
+	gtk_widget_set_sensitive(widgets->textview, FALSE);
+	g_signal_handlers_block_by_func(buffer, on_textbuffer1_changed, widgets->fh);
+	undo_history_begin_not_undoable(widgets->history);
+	gtk_text_buffer_set_text(buffer, "", -1);
+	undo_history_end_not_undoable(widgets->history);
+	g_signal_handlers_unblock_by_func(buffer, on_textbuffer1_changed, widgets->fh);
+	return TRUE;
+}
+
+static gboolean notepad_wake(const gchar *filename, gpointer data)
+{
+	struct GUI_widgets *widgets = data;
+	GError *error = NULL;
+	gchar *contents;
+	gsize length;
+	IoEngineFileId id;
+
+	if (!file_loader_read_file(filename, &contents, &length, &id, &error))
+	{
+		showErrorMessage(GTK_WINDOW(widgets->main_window), error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+
+	// Nor is loading it back
+	GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(widgets->textview));
+	g_signal_handlers_block_by_func(buffer, on_textbuffer1_changed, widgets->fh);
+	load_text(widgets, contents, length);
+	g_signal_handlers_unblock_by_func(buffer, on_textbuffer1_changed, widgets->fh);
+	g_free(contents);
+
+	// Text loaded back from a spill file isn't the saved one
+	if (g_strcmp0(filename, filehandler_get_filename(widgets->fh)) != 0)
+		undo_history_clear(widgets->history);
+	else
+		set_text_saved(widgets, &id, length);
+	update_memory_usage(widgets);
+
+	set_view_position(widgets, widgets->hibernated_cursor, widgets->hibernated_top);
+	gtk_widget_set_sensitive(widgets->textview, TRUE);
+	return TRUE;
+}
+
+static gchar *notepad_contents(gsize *length, gpointer data)
+{
+	struct GUI_widgets *widgets = data;
+
+	TextSnapshot *snapshot = text_mirror_snapshot(widgets->mirror);
+	gchar *contents = text_snapshot_flatten(snapshot, length);
+	text_snapshot_free(snapshot);
+	return contents;
+}
+
 static void notepad_close(gpointer data)
 {
 	struct GUI_widgets *widgets = data;
+
+	// Remember it for the session, as window may be closing
+	SessionDocument doc;
+	get_session_document(widgets, &doc);
+	g_free(widgets->closed_filename);
+	widgets->closed_filename = doc.filename;
+	widgets->closed_cursor = doc.cursor;
+	widgets->closed_top = doc.top;
+
+	stop_preview(widgets);
 	gtk_widget_set_sensitive(widgets->textview, FALSE);
+	undo_history_begin_not_undoable(widgets->history);
 	gtk_text_buffer_set_text(GTK_TEXT_BUFFER(gtk_text_view_get_buffer(GTK_TEXT_VIEW(widgets->textview))), "", -1);
+	undo_history_end_not_undoable(widgets->history);
+}
+
+
+static void notepad_open_many(const gchar * const *filenames, gpointer data)
+{
+	struct GUI_widgets *widgets = data;
+
+	notepad_open_files(filenames, widgets);
 }
 
+// Free window resources when main loop is idle,
+//   as Filehandler may still be running
+static gboolean free_window(gpointer data)
+{
+	struct GUI_widgets *widgets = data;
+
+	undo_history_destroy(widgets->history);
+	text_mirror_destroy(widgets->mirror);
+	filehandler_destroy(widgets->fh);
+	g_free(widgets->preloaded);
+	g_free(widgets->pending_filename);
+	g_free(widgets->closed_filename);
+	g_free(widgets);
+	return FALSE;
+}
+
+// Write the session: documents of the last windows, then those kept from
+//   a quit given up. The first of them is the active one.
+static void save_session(const SessionDocument *documents, guint n_documents)
+{
+	Session *saved = session_new();
+	guint n, m;
+
+	saved->last_dir = g_strdup(session->last_dir);
+	for (n = 0; n < n_documents; n++)
+		if (documents[n].filename != NULL)
+			session_add_document(saved, documents[n].filename, documents[n].cursor,
+					documents[n].top, n == 0);
+
+	// Unless they were opened again
+	for (n = 0; n < session->documents->len; n++)
+	{
+		const SessionDocument *kept = &g_array_index(session->documents, SessionDocument, n);
+		for (m = 0; m < n_documents; m++)
+			if (g_strcmp0(documents[m].filename, kept->filename) == 0)
+				break;
+		if (m == n_documents)
+			session_add_document(saved, kept->filename, kept->cursor, kept->top, FALSE);
+	}
+
+	gchar *path = session_get_default_path();
+	session_save(saved, path, NULL);
+	g_free(path);
+	session_free(saved);
+}
+
+// Window was closed
+//   If it was the last one, application quits and its document goes to the
+//   session. While quitting, documents were taken already.
+static void notepad_quit(gpointer data)
+{
+	struct GUI_widgets *widgets = data;
+
+	windows = g_list_remove(windows, widgets);
+	g_idle_add(free_window, widgets);
+
+	if (quit_windows != NULL)
+	{
+		// It may have been saved as another file before closing
+		gint n = g_list_index(quit_windows, widgets);
+		if (n >= 0 && widgets->closed_filename != NULL)
+		{
+			SessionDocument *doc = &g_array_index(quit_documents, SessionDocument, n);
+			g_free(doc->filename);
+			doc->filename = g_strdup(widgets->closed_filename);
+			doc->cursor = widgets->closed_cursor;
+			doc->top = widgets->closed_top;
+		}
+		return;
+	}
+
+	if (windows == NULL)
+	{
+		SessionDocument doc = { widgets->pending_filename,
+				widgets->pending_cursor, widgets->pending_top };
+		if (doc.filename == NULL)
+		{
+			doc.filename = widgets->closed_filename;
+			doc.cursor = widgets->closed_cursor;
+			doc.top = widgets->closed_top;
+		}
+
+		g_free(session->last_dir);
+		session->last_dir = g_strdup(filehandler_get_directory(widgets->fh));
+		save_session(&doc, 1);
+		gtk_main_quit();
+	}
+}
+
+// Quit: close every window, starting from this one
+//   Documents of all windows are taken first; session is written only if
+//   every window was closed. If user gives up closing one of them, the
+//   others are kept, and documents of those closed already are kept for
+//   the session of next quit.
+G_MODULE_EXPORT
+void notepad_on_action_quit_activate(GtkAction *action, gpointer data)
+{
+	Filehandler *fh = data;
+	struct GUI_widgets *widgets = fh->user_data;
+	GList *it;
+
+	if (quit_windows != NULL)
+		return;
+
+	quit_windows = g_list_copy(windows);
+	quit_windows = g_list_remove(quit_windows, widgets);
+	quit_windows = g_list_prepend(quit_windows, widgets);
+
+	quit_documents = g_array_new(FALSE, FALSE, sizeof(SessionDocument));
+	g_free(session->last_dir);
+	session->last_dir = NULL;
+	for (it = quit_windows; it != NULL; it = it->next)
+	{
+		struct GUI_widgets *window = it->data;
+		SessionDocument doc;
+
+		get_session_document(window, &doc);
+		g_array_append_val(quit_documents, doc);
+		// What is set from now on is a document closed by this quit
+		g_free(window->closed_filename);
+		window->closed_filename = NULL;
+
+		if (session->last_dir == NULL)
+			session->last_dir = g_strdup(filehandler_get_directory(window->fh));
+	}
+
+	for (it = quit_windows; it != NULL; it = it->next)
+	{
+		struct GUI_widgets *window = it->data;
+		if (g_list_find(windows, window) == NULL)
+			continue;
+		filehandler_on_action_quit_activate(action, window->fh);
+		if (g_list_find(windows, window) != NULL)
+			break;
+	}
+
+	guint n;
+	if (windows == NULL)
+	{
+		save_session((SessionDocument *) quit_documents->data, quit_documents->len);
+		gtk_main_quit();
+	}
+	else
+	{
+		// Gave up: keep documents of windows closed already
+		for (n = 0, it = quit_windows; it != NULL; n++, it = it->next)
+		{
+			SessionDocument *doc = &g_array_index(quit_documents, SessionDocument, n);
+			if (doc->filename != NULL && g_list_find(windows, it->data) == NULL)
+				session_add_document(session, doc->filename, doc->cursor, doc->top, FALSE);
+		}
+	}
+
+	for (n = 0; n < quit_documents->len; n++)
+		g_free(g_array_index(quit_documents, SessionDocument, n).filename);
+	g_array_free(quit_documents, TRUE);
+	quit_documents = NULL;
+	g_list_free(quit_windows);
+	quit_windows = NULL;
+}
+
+// Edit actions
+//   As GTK callbacks, data contains a Filehandler pointer
+
+G_MODULE_EXPORT
+void notepad_on_action_undo_activate(GtkAction *action, gpointer data)
+{
+	Filehandler *fh = data;
+	struct GUI_widgets *widgets = fh->user_data;
+
+	undo_history_undo(widgets->history);
+}
+
+G_MODULE_EXPORT
+void notepad_on_action_redo_activate(GtkAction *action, gpointer data)
+{
+	Filehandler *fh = data;
+	struct GUI_widgets *widgets = fh->user_data;
+
+	undo_history_redo(widgets->history);
+}
+
+// View > Truncated preview
+//   Only a saved document is previewed, as its undo history is dropped.
+G_MODULE_EXPORT
+void notepad_on_action_preview_toggled(GtkToggleAction *action, gpointer data)
+{
+	Filehandler *fh = data;
+	struct GUI_widgets *widgets = fh->user_data;
+	gboolean active = gtk_toggle_action_get_active(action);
+
+	if (active == text_mirror_is_frozen(widgets->mirror))
+		return;
+	if (!active)
+	{
+		stop_preview(widgets);
+		return;
+	}
+
+	if (filehandler_get_filename(fh) == NULL || !fh->file_changes_saved)
+	{
+		if (filehandler_get_filename(fh) != NULL)
+			showWarningMessage(GTK_WINDOW(widgets->main_window),
+					_("Save the document before previewing it."));
+		gtk_toggle_action_set_active(action, FALSE);
+		return;
+	}
+	start_preview(widgets);
+}
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Time from exec to first frame of simple-notepad, in milliseconds
+#   The program is given the time it's run at, by wall clock, and tells how
+#   long after it its first frame was drawn. Don't change the clock meanwhile.
+#   Usage: startup-benchmark.sh [PROGRAM] [RUNS]
+#   Each run starts with an empty configuration, so no session is restored.
+
+program=${1:-./simple-notepad}
+runs=${2:-10}
+
+config=$(mktemp -d) || exit 1
+trap 'rm -rf "$config"' EXIT
+
+i=0
+while [ "$i" -lt "$runs" ]; do
+	start=$(date +%s%N)
+	XDG_CONFIG_HOME="$config" "$program" --time-startup=$((start / 1000)) || exit 1
+	i=$((i + 1))
+done | sort -n | awk '
+	{ t[NR] = $1 }
+	END {
+		if (NR == 0) exit 1
+		printf "runs %d  min %.1f ms  median %.1f ms  max %.1f ms\n",
+			NR, t[1] / 1000, t[int((NR + 1) / 2)] / 1000, t[NR] / 1000
+	}'
@@ -0,0 +1,230 @@
+/*
+ * Copyright © 2011 Rodolfo Ribeiro Gomes <rodolforg arr0ba gmail.com>
+ *
+ * A file handler for GTK+
+ *
+    This file is part of GtkFileHandler.
+
+    GtkFileHandler is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GtkFileHandler is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GtkFileHandler.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "action_trace.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <glib/gi18n.h>
+#include <glib/gstdio.h>
+
+///////////////////////////////////
+// For internal use
+///////////////////////////////////
+
+// File layout (integers are little-endian):
+//   magic, version (32-bit), then events until the end of file, each as
+//   kind (8-bit), code (8-bit), document, value, duration (32-bit) and
+//   filename: its length (32-bit) followed by its bytes (no NUL).
+static const gchar TRACE_MAGIC[4] = { 'F', 'H', 'T', 'R' };
+#define TRACE_VERSION 1
+
+struct _ActionTraceWriter {
+	FILE *file;
+	GString *buffer;
+};
+
+static void put_byte(GString *out, guint8 value)
+{
+	g_string_append_c(out, (gchar) value);
+}
+
+static void put_int(GString *out, guint32 value)
+{
+	guint32 le = GUINT32_TO_LE(value);
+	g_string_append_len(out, (const gchar *) &le, sizeof(le));
+}
+
+// Reading cursor over loaded file contents
+typedef struct {
+	const gchar *pos;
+	const gchar *end;
+} Reader;
+
+static gboolean get_byte(Reader *in, guint8 *value)
+{
+	if (in->pos >= in->end)
+		return FALSE;
+	*value = (guint8) *in->pos++;
+	return TRUE;
+}
+
+static gboolean get_int(Reader *in, guint32 *value)
+{
+	guint32 le;
+	if (in->end - in->pos < (gssize) sizeof(le))
+		return FALSE;
+	memcpy(&le, in->pos, sizeof(le));
+	in->pos += sizeof(le);
+	*value = GUINT32_FROM_LE(le);
+	return TRUE;
+}
+
+static gboolean get_header(Reader *in)
+{
+	guint32 version;
+	if (in->end - in->pos < (gssize) sizeof(TRACE_MAGIC)
+			|| memcmp(in->pos, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0)
+		return FALSE;
+	in->pos += sizeof(TRACE_MAGIC);
+	return get_int(in, &version) && version == TRACE_VERSION;
+}
+
+static gboolean get_event(Reader *in, ActionTraceEvent *event)
+{
+	guint8 kind, code;
+	guint32 document, value, duration, len;
+
+	if (!get_byte(in, &kind) || !get_byte(in, &code) || !get_int(in, &document)
+			|| !get_int(in, &value) || !get_int(in, &duration) || !get_int(in, &len)
+			|| in->end - in->pos < (gssize) len)
+		return FALSE;
+
+	event->kind = kind;
+	event->code = code;
+	event->document = document;
+	event->value = (gint32) value;
+	event->duration = duration;
+	event->filename = len > 0 ? g_strndup(in->pos, len) : NULL;
+	in->pos += len;
+	return TRUE;
+}
+
+///////////////////////////////////
+// Reading
+///////////////////////////////////
+
+// Read a trace written by ActionTraceWriter
+ActionTrace *action_trace_load(const gchar *path, GError **error)
+{
+	gchar *contents;
+	gsize length;
+
+	g_return_val_if_fail(path != NULL, NULL);
+
+	if (!g_file_get_contents(path, &contents, &length, error))
+		return NULL;
+
+	Reader in = { contents, contents + length };
+	if (!get_header(&in))
+	{
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+				_("\"%s\" isn't a trace file."), path);
+		g_free(contents);
+		return NULL;
+	}
+
+	ActionTrace *trace = g_new0(ActionTrace, 1);
+	trace->events = g_array_new(FALSE, TRUE, sizeof(ActionTraceEvent));
+
+	ActionTraceEvent event;
+	while (get_event(&in, &event))
+		g_array_append_val(trace->events, event);
+
+	g_free(contents);
+	return trace;
+}
+
+void action_trace_free(ActionTrace *trace)
+{
+	if (trace == NULL)
+		return;
+
+	guint n;
+	for (n = 0; n < trace->events->len; n++)
+		g_free(g_array_index(trace->events, ActionTraceEvent, n).filename);
+	g_array_free(trace->events, TRUE);
+	g_free(trace);
+}
+
+///////////////////////////////////
+// Writing
+///////////////////////////////////
+
+ActionTraceWriter *action_trace_writer_new(const gchar *path, GError **error)
+{
+	g_return_val_if_fail(path != NULL, NULL);
+
+	FILE *file = g_fopen(path, "wb");
+	if (file == NULL)
+	{
+		gint err_no = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err_no),
+				_("Couldn't create trace file \"%s\": %s"), path, g_strerror(err_no));
+		return NULL;
+	}
+
+	ActionTraceWriter *writer = g_new0(ActionTraceWriter, 1);
+	writer->file = file;
+	writer->buffer = g_string_sized_new(64);
+
+	g_string_append_len(writer->buffer, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	put_int(writer->buffer, TRACE_VERSION);
+	fwrite(writer->buffer->str, 1, writer->buffer->len, file);
+	fflush(file);
+	return writer;
+}
+
+void action_trace_writer_add(ActionTraceWriter *writer, const ActionTraceEvent *event)
+{
+	g_return_if_fail(writer != NULL && event != NULL);
+
+	gsize len = event->filename != NULL ? strlen(event->filename) : 0;
+	GString *out = writer->buffer;
+
+	g_string_truncate(out, 0);
+	put_byte(out, event->kind);
+	put_byte(out, event->code);
+	put_int(out, event->document);
+	put_int(out, (guint32) event->value);
+	put_int(out, event->duration);
+	put_int(out, len);
+	g_string_append_len(out, event->filename, len);
+
+	fwrite(out->str, 1, out->len, writer->file);
+	fflush(writer->file);
+}
+
+void action_trace_writer_close(ActionTraceWriter *writer)
+{
+	if (writer == NULL)
+		return;
+	fclose(writer->file);
+	g_string_free(writer->buffer, TRUE);
+	g_free(writer);
+}
+
+///////////////////////////////////
+// Names
+///////////////////////////////////
+
+const gchar *action_trace_get_action_name(guint action)
+{
+	static const gchar * const names[] = { "new", "open", "save", "save as", "close", "quit" };
+	return action < G_N_ELEMENTS(names) ? names[action] : "?";
+}
+
+const gchar *action_trace_get_callback_name(guint callback)
+{
+	static const gchar * const names[] = { "new", "open", "save", "save as", "close", "background save" };
+	return callback < G_N_ELEMENTS(names) ? names[callback] : "?";
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright © 2011 Rodolfo Ribeiro Gomes <rodolforg arr0ba gmail.com>
+ *
+ * A file handler for GTK+
+ *
+    This file is part of GtkFileHandler.
+
+    GtkFileHandler is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GtkFileHandler is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GtkFileHandler.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef R_ACTION_TRACE_H_
+#define R_ACTION_TRACE_H_
+
+#include <glib.h>
+
+// A trace of what happened to documents, to be replayed later
+//   It keeps file actions asked by the user, the answers the user gave to
+//   prompts and file dialogs, and how long each application callback took.
+//   Texts typed aren't kept: only that a document was changed.
+typedef enum {
+	ACTION_TRACE_ACTION,   // code is an ActionTraceAction
+	ACTION_TRACE_EDIT,     // value tells if document is now changed
+	ACTION_TRACE_ANSWER,   // value is the GtkResponseType; filename, if any, was chosen
+	ACTION_TRACE_FILE,     // one more file chosen with last answer
+	ACTION_TRACE_CALLBACK  // code is an ActionTraceCallback; duration is set
+} ActionTraceKind;
+
+typedef enum {
+	ACTION_TRACE_NEW,
+	ACTION_TRACE_OPEN,
+	ACTION_TRACE_SAVE,
+	ACTION_TRACE_SAVE_AS,
+	ACTION_TRACE_CLOSE,
+	ACTION_TRACE_QUIT
+} ActionTraceAction;
+
+typedef enum {
+	ACTION_TRACE_CALLBACK_NEW,
+	ACTION_TRACE_CALLBACK_OPEN,
+	ACTION_TRACE_CALLBACK_SAVE,
+	ACTION_TRACE_CALLBACK_SAVE_AS,
+	ACTION_TRACE_CALLBACK_CLOSE,
+	ACTION_TRACE_CALLBACK_SAVE_SNAPSHOT
+} ActionTraceCallback;
+
+// document tells which one it happened to; duration is in microseconds.
+typedef struct {
+	ActionTraceKind kind;
+	guint code;
+	guint document;
+	gint value;
+	guint duration;
+	gchar *filename;
+} ActionTraceEvent;
+
+// A loaded trace: an array of ActionTraceEvent
+typedef struct {
+	GArray *events;
+} ActionTrace;
+
+// Read a trace written by ActionTraceWriter
+//   A trace cut short, e.g. by a crash, is read up to where it was cut.
+//   Returns NULL if it can't be read or isn't a trace.
+ActionTrace *action_trace_load(const gchar *path, GError **error);
+
+void action_trace_free(ActionTrace *trace);
+
+// Writes a trace event by event, flushing each one, so a trace of a
+//   session that crashes is kept.
+typedef struct _ActionTraceWriter ActionTraceWriter;
+
+ActionTraceWriter *action_trace_writer_new(const gchar *path, GError **error);
+void action_trace_writer_add(ActionTraceWriter *writer, const ActionTraceEvent *event);
+void action_trace_writer_close(ActionTraceWriter *writer);
+
+// Names for reports
+const gchar *action_trace_get_action_name(guint action);
+const gchar *action_trace_get_callback_name(guint callback);
+
+#endif // R_ACTION_TRACE_H_
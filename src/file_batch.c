@@ -0,0 +1,170 @@
+/*
+ * Copyright © 2011 Rodolfo Ribeiro Gomes <rodolforg arr0ba gmail.com>
+ *
+ * A file handler for GTK+
+ *
+    This file is part of GtkFileHandler.
+
+    GtkFileHandler is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GtkFileHandler is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GtkFileHandler.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "file_batch.h"
+#include "file_loader.h"
+#include "io_engine.h"
+
+#include <string.h>
+
+///////////////////////////////////
+// For internal use
+///////////////////////////////////
+
+typedef struct {
+	const gchar * const *filenames;
+	guint n_files;
+	// Next file to be taken by a worker
+	volatile gint next;
+	FileBatchFunc transform;
+	gpointer user_data;
+	FileBatchStats *stats;
+} Batch;
+
+G_LOCK_DEFINE_STATIC(stats);
+
+static void init_threads(void)
+{
+#if !GLIB_CHECK_VERSION(2,32,0)
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+#endif
+}
+
+static guint take_next(Batch *batch)
+{
+#if GLIB_CHECK_VERSION(2,30,0)
+	return g_atomic_int_add(&batch->next, 1);
+#else
+	return g_atomic_int_exchange_and_add(&batch->next, 1);
+#endif
+}
+
+// Read, transform and write back a file
+//   Returns TRUE if it was written, FALSE if it was already as it should be.
+static gboolean process_file(Batch *batch, const gchar *filename, guint64 *bytes,
+		GError **error)
+{
+	gchar *contents;
+	gsize length;
+
+	if (!io_engine_read_file(filename, &contents, &length, NULL, error))
+		return FALSE;
+	*bytes += length;
+
+	gboolean changed = !g_utf8_validate(contents, length, NULL);
+	if (changed && !file_loader_to_utf8(&contents, &length, error))
+	{
+		g_free(contents);
+		return FALSE;
+	}
+
+	if (batch->transform != NULL && batch->transform(&contents, &length, batch->user_data))
+		changed = TRUE;
+
+	if (changed && !io_engine_write_file(filename, contents, length, error))
+		changed = FALSE;
+	g_free(contents);
+	return changed;
+}
+
+// Runs on a worker thread, until there is no file left
+//   Counts are kept apart and added at the end, so workers don't contend.
+static void run_worker(gpointer data, gpointer pool_data)
+{
+	Batch *batch = pool_data;
+	FileBatchStats local = { 0, 0, 0, 0, 0, 0, NULL };
+	guint n;
+
+	while ((n = take_next(batch)) < batch->n_files)
+	{
+		const gchar *filename = batch->filenames[n];
+		GError *error = NULL;
+
+		local.files++;
+		if (process_file(batch, filename, &local.bytes, &error))
+			local.written++;
+		else if (error == NULL)
+			local.unchanged++;
+		else
+		{
+			local.failed++;
+			gchar *message = g_strdup_printf("%s: %s", filename, error->message);
+			g_error_free(error);
+			G_LOCK(stats);
+			g_ptr_array_add(batch->stats->errors, message);
+			G_UNLOCK(stats);
+		}
+	}
+
+	G_LOCK(stats);
+	batch->stats->files += local.files;
+	batch->stats->written += local.written;
+	batch->stats->unchanged += local.unchanged;
+	batch->stats->failed += local.failed;
+	batch->stats->bytes += local.bytes;
+	G_UNLOCK(stats);
+}
+
+///////////////////////////////////
+// Public functions
+///////////////////////////////////
+
+void file_batch_run(const gchar * const *filenames, guint n_files, gint max_threads,
+		FileBatchFunc transform, gpointer user_data, FileBatchStats *stats)
+{
+	g_return_if_fail(stats != NULL);
+	g_return_if_fail(filenames != NULL || n_files == 0);
+
+	memset(stats, 0, sizeof(*stats));
+	stats->errors = g_ptr_array_new();
+	if (n_files == 0)
+		return;
+
+	init_threads();
+
+	if (max_threads <= 0)
+		max_threads = file_loader_default_threads();
+	if ((guint) max_threads > n_files)
+		max_threads = n_files;
+
+	Batch batch = { filenames, n_files, 0, transform, user_data, stats };
+	GTimer *timer = g_timer_new();
+
+	// Each worker takes files one by one from a shared counter
+	GThreadPool *pool = g_thread_pool_new(run_worker, &batch, max_threads, TRUE, NULL);
+	gint n;
+	for (n = 0; n < max_threads; n++)
+		g_thread_pool_push(pool, GINT_TO_POINTER(n + 1), NULL);
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	stats->seconds = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+}
+
+void file_batch_stats_clear(FileBatchStats *stats)
+{
+	if (stats == NULL || stats->errors == NULL)
+		return;
+	g_ptr_array_foreach(stats->errors, (GFunc) g_free, NULL);
+	g_ptr_array_free(stats->errors, TRUE);
+	stats->errors = NULL;
+}
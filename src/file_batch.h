@@ -0,0 +1,59 @@
+/*
+ * Copyright © 2011 Rodolfo Ribeiro Gomes <rodolforg arr0ba gmail.com>
+ *
+ * A file handler for GTK+
+ *
+    This file is part of GtkFileHandler.
+
+    GtkFileHandler is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GtkFileHandler is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GtkFileHandler.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef R_FILE_BATCH_H_
+#define R_FILE_BATCH_H_
+
+#include <glib.h>
+
+// Open, transform and save many files, without any window
+//   Each file is read and converted to UTF-8 as file_loader_read_file() does,
+//   handed to a transform function, and written back atomically (see
+//   io_engine_write_file()) only if its text changed. Files go through
+//   worker threads that take the next one as soon as they're free, so a few
+//   big files don't hold the others back.
+
+// Change text of a file, replacing contents (free the old one with g_free())
+//   and length as needed. Returns TRUE if it changed the text.
+//   Called from worker threads.
+typedef gboolean (*FileBatchFunc)(gchar **contents, gsize *length, gpointer user_data);
+
+typedef struct {
+	guint files;
+	guint written;
+	guint unchanged;
+	guint failed;
+	// Bytes read
+	guint64 bytes;
+	gdouble seconds;
+	// Why each failed file failed, as "filename: message"
+	GPtrArray *errors;
+} FileBatchStats;
+
+// Process n_files filenames on max_threads threads (processors if <= 0).
+//   transform may be NULL, e.g. to just convert files to UTF-8.
+//   It returns when every file is done; stats must be cleared afterwards.
+void file_batch_run(const gchar * const *filenames, guint n_files, gint max_threads,
+		FileBatchFunc transform, gpointer user_data, FileBatchStats *stats);
+
+void file_batch_stats_clear(FileBatchStats *stats);
+
+#endif // R_FILE_BATCH_H_
@@ -0,0 +1,191 @@
+/*
+ * Copyright © 2011 Rodolfo Ribeiro Gomes <rodolforg arr0ba gmail.com>
+ *
+ * A file handler for GTK+
+ *
+    This file is part of GtkFileHandler.
+
+    GtkFileHandler is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GtkFileHandler is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GtkFileHandler.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "file_loader.h"
+
+#include <string.h>
+
+///////////////////////////////////
+// For internal use
+///////////////////////////////////
+
+// A bunch of files being read together
+typedef struct {
+	GThreadPool *pool;
+	guint pending;
+	FileLoaderReadyFunc ready;
+	FileLoaderDoneFunc done;
+	gpointer user_data;
+} LoadBatch;
+
+// A single file of a batch
+typedef struct {
+	LoadBatch *batch;
+	gchar *filename;
+	gchar *contents;
+	gsize length;
+	IoEngineFileId id;
+	GError *error;
+} LoadItem;
+
+static void init_threads(void)
+{
+#if !GLIB_CHECK_VERSION(2,32,0)
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+#endif
+}
+
+// Convert contents to UTF-8, if it isn't yet.
+gboolean file_loader_to_utf8(gchar **contents, gsize *length, GError **error)
+{
+	if (g_utf8_validate(*contents, *length, NULL))
+		return TRUE;
+
+	const gchar *charset;
+	gchar *converted = NULL;
+	gsize written;
+
+	if (!g_get_charset(&charset))
+		converted = g_convert(*contents, *length, "UTF-8", charset, NULL, &written, NULL);
+	if (converted == NULL)
+		converted = g_convert(*contents, *length, "UTF-8", "ISO-8859-1", NULL, &written, error);
+	if (converted == NULL)
+		return FALSE;
+
+	g_free(*contents);
+	*contents = converted;
+	*length = written;
+	return TRUE;
+}
+
+// Runs on main loop: deliver a read file
+static gboolean deliver_item(gpointer data)
+{
+	LoadItem *item = data;
+	LoadBatch *batch = item->batch;
+
+	batch->ready(item->filename, item->contents, item->length, &item->id, item->error,
+			batch->user_data);
+
+	if (item->error != NULL)
+		g_error_free(item->error);
+	g_free(item->filename);
+	g_free(item);
+
+	batch->pending--;
+	if (batch->pending == 0)
+	{
+		if (batch->done != NULL)
+			batch->done(batch->user_data);
+		g_thread_pool_free(batch->pool, FALSE, TRUE);
+		g_free(batch);
+	}
+	return FALSE;
+}
+
+// Runs on a worker thread
+static void read_item(gpointer data, gpointer pool_data)
+{
+	LoadItem *item = data;
+
+	if (!file_loader_read_file(item->filename, &item->contents, &item->length,
+			&item->id, &item->error))
+		item->contents = NULL;
+
+	// Default idle priority lets GTK+ redraw between two documents
+	g_idle_add(deliver_item, item);
+}
+
+///////////////////////////////////
+// Public functions
+///////////////////////////////////
+
+gint file_loader_default_threads(void)
+{
+#if GLIB_CHECK_VERSION(2,36,0)
+	return g_get_num_processors();
+#else
+	return 4;
+#endif
+}
+
+// Read a whole text file and convert it to UTF-8 if needed.
+gboolean file_loader_read_file(const gchar *filename, gchar **contents,
+		gsize *length, IoEngineFileId *id, GError **error)
+{
+	// A crash may have left a patch of a file being edited unfinished
+	GError *recover_error = NULL;
+	if (!io_engine_recover_file(filename, &recover_error))
+	{
+		g_warning("%s", recover_error->message);
+		g_error_free(recover_error);
+	}
+
+	if (!io_engine_read_file(filename, contents, length, id, error))
+		return FALSE;
+
+	if (!file_loader_to_utf8(contents, length, error))
+	{
+		g_free(*contents);
+		*contents = NULL;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// Read many files in parallel, on worker threads.
+void file_loader_read_files(const gchar * const *filenames, gint max_threads,
+		FileLoaderReadyFunc ready, FileLoaderDoneFunc done, gpointer user_data)
+{
+	g_return_if_fail(ready != NULL);
+
+	guint n_files = filenames != NULL ? g_strv_length((gchar **) filenames) : 0;
+	if (n_files == 0)
+	{
+		if (done != NULL)
+			done(user_data);
+		return;
+	}
+
+	init_threads();
+
+	if (max_threads <= 0)
+		max_threads = file_loader_default_threads();
+	if ((guint) max_threads > n_files)
+		max_threads = n_files;
+
+	LoadBatch *batch = g_new0(LoadBatch, 1);
+	batch->pending = n_files;
+	batch->ready = ready;
+	batch->done = done;
+	batch->user_data = user_data;
+	batch->pool = g_thread_pool_new(read_item, batch, max_threads, FALSE, NULL);
+
+	guint n;
+	for (n = 0; n < n_files; n++)
+	{
+		LoadItem *item = g_new0(LoadItem, 1);
+		item->batch = batch;
+		item->filename = g_strdup(filenames[n]);
+		g_thread_pool_push(batch->pool, item, NULL);
+	}
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright © 2011 Rodolfo Ribeiro Gomes <rodolforg arr0ba gmail.com>
+ *
+ * A file handler for GTK+
+ *
+    This file is part of GtkFileHandler.
+
+    GtkFileHandler is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GtkFileHandler is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GtkFileHandler.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef R_FILE_LOADER_H_
+#define R_FILE_LOADER_H_
+
+#include <glib.h>
+
+#include "io_engine.h"
+
+// Called from main loop for each file, as soon as it has been read.
+//   On success, contents is UTF-8 text (NUL-terminated) and the callee owns it:
+//   free it with g_free(). id is what the file read was. On failure,
+//   contents is NULL and error says why.
+typedef void (*FileLoaderReadyFunc)(const gchar *filename, gchar *contents,
+		gsize length, const IoEngineFileId *id, const GError *error, gpointer user_data);
+
+// Called from main loop when every file has been delivered.
+typedef void (*FileLoaderDoneFunc)(gpointer user_data);
+
+// Read a whole text file and convert it to UTF-8 if needed.
+//   It doesn't touch GTK+, so it can be called from any thread.
+//   As the file is going to be edited, a patch of it interrupted by a crash
+//   is finished first (see io_engine_recover_file()).
+//   If contents isn't valid UTF-8, it's taken as being in locale charset
+//   or, at last, in ISO-8859-1. id may be NULL (see io_engine_read_file()).
+gboolean file_loader_read_file(const gchar *filename, gchar **contents,
+		gsize *length, IoEngineFileId *id, GError **error);
+
+// Convert text to UTF-8, the same way, if it isn't yet.
+//   contents is replaced (and the old one freed) if it was converted.
+gboolean file_loader_to_utf8(gchar **contents, gsize *length, GError **error);
+
+// Read many files in parallel, on worker threads.
+//   ready is called for each file in the order they finish being read,
+//   not in the order of filenames, so the first one can be shown while the
+//   others are still loading. done may be NULL.
+//   If max_threads <= 0, it uses as many threads as processors.
+//   It returns immediately; filenames is copied.
+void file_loader_read_files(const gchar * const *filenames, gint max_threads,
+		FileLoaderReadyFunc ready, FileLoaderDoneFunc done, gpointer user_data);
+
+// Number of worker threads to use by default
+gint file_loader_default_threads(void);
+
+#endif // R_FILE_LOADER_H_
@@ -21,13 +21,24 @@
  
 #include "filehandler.h"
 #include "message_dialogs.h"
+#include "text_diff.h"
+
+#include <string.h>
+#include <unistd.h>
 
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
 
 ///////////////////////////////////
 // Contructors & destructors
 ///////////////////////////////////
 
+// Every Filehandler, most recently used first
+static GList *documents = NULL;
+
+// A document is being hibernated or waken up: its text is only swapped
+static gboolean hibernating = FALSE;
+
 // Allocate and initialize a Filehandler structure
 Filehandler *filehandler_new(FilehandlerCallbacks *callbacks, GtkWidget *main_window, gpointer user_data)
 {
@@ -42,6 +53,10 @@ Filehandler *filehandler_new(FilehandlerCallbacks *callbacks, GtkWidget *main_wi
 	fh->main_window = main_window;
 	fh->user_data = user_data;
 
+	static guint next_trace_id = 0;
+	fh->trace_id = ++next_trace_id;
+	documents = g_list_prepend(documents, fh);
+
 	return fh;
 }
 
@@ -51,6 +66,16 @@ void filehandler_destroy(Filehandler *fh)
 {
 	if (fh == NULL)
 		return;
+	// A background save still needs it: it'll be freed when done
+	if (fh->saving != NULL)
+	{
+		fh->destroy_pending = TRUE;
+		return;
+	}
+	documents = g_list_remove(documents, fh);
+	if (fh->spill_filename != NULL)
+		g_unlink(fh->spill_filename);
+	g_free(fh->spill_filename);
 	g_free(fh->current_filename);
 	g_free(fh->last_dir);
 	g_free(fh);
@@ -70,6 +95,10 @@ static gchar * const FILENAME_NOT_SAVED="";
 //   Otherwise, ask the user what to do: discard changes, save them or don't close it.
 static gboolean try_close_file(Filehandler *fh);
 
+// Add an event to the trace being recorded, if any
+static void trace_event(Filehandler *fh, ActionTraceKind kind, guint code, gint value,
+		guint duration, const gchar *filename);
+
 // Checks if the name of current file is not empty or a default for new ones.
 static gboolean is_file_named(Filehandler *fh)
 {
@@ -92,14 +121,29 @@ const gchar *filehandler_get_directory(const Filehandler *fh)
 	return fh != NULL? fh->last_dir : NULL;
 }
 
+// Set the directory where file dialogs start browsing,
+//   e.g., one remembered from a previous session.
+void filehandler_set_directory(Filehandler *fh, const gchar *dirname)
+{
+	if (fh == NULL)
+		return;
+	g_free(fh->last_dir);
+	fh->last_dir = g_strdup(dirname);
+}
+
 // Tell Filehandler that the file has been changed.
 //   You should really use this, as based on this information,
 //   the user will be asked or not if he wants to save/close the file
 //   when he tries to open another one or close the current one.
 void filehandler_file_changed(Filehandler *fh, gboolean changed)
 {
-	if (fh != NULL && !IS_CLOSED(fh))
+	// Swapping text in or out isn't an edit, nor is it traced
+	if (fh != NULL && !IS_CLOSED(fh) && !hibernating)
 	{
+		if (changed)
+			fh->change_serial++;
+		if (changed == fh->file_changes_saved)
+			trace_event(fh, ACTION_TRACE_EDIT, 0, changed, 0, NULL);
 		fh->file_changes_saved = !changed;
 		if (fh->actions.save != NULL)
 			gtk_action_set_sensitive(fh->actions.save, !fh->file_changes_saved);
@@ -121,6 +165,524 @@ void filehandler_update_action_status(const Filehandler *fh)
 
 }
 
+///////////////////////////////////
+// Tracing
+///////////////////////////////////
+
+static ActionTraceWriter *trace_writer = NULL;
+// Times callbacks while recording or replaying
+static GTimer *trace_timer = NULL;
+
+// Trace being replayed
+typedef struct {
+	ActionTrace *trace;
+	guint next;
+	FilehandlerReplayCallbacks callbacks;
+	gpointer user_data;
+	// How long replay has been waiting for the application to catch up
+	GTimer *waiting;
+	gboolean is_waiting;
+	// An event taken out of order
+	ActionTraceEvent taken;
+} Replay;
+static Replay *replay = NULL;
+
+// How long to wait for the application to do what the trace says it did
+#define REPLAY_PATIENCE 2.0
+
+#define REPLAY_EVENT(n) (&g_array_index(replay->trace->events, ActionTraceEvent, (n)))
+
+// How often to look again while waiting, in milliseconds
+#define REPLAY_POLL 10
+
+static void trace_event(Filehandler *fh, ActionTraceKind kind, guint code, gint value,
+		guint duration, const gchar *filename)
+{
+	if (trace_writer == NULL)
+		return;
+	ActionTraceEvent event = { kind, code, fh->trace_id, value, duration, (gchar *) filename };
+	action_trace_writer_add(trace_writer, &event);
+}
+
+static void trace_action(Filehandler *fh, ActionTraceAction action, const gchar *filename)
+{
+	trace_event(fh, ACTION_TRACE_ACTION, action, 0, 0, filename);
+}
+
+// The next event of trace being replayed, if it's of kind (and code, if >= 0)
+//   Edits in the way are passed over: those made by the application itself
+//   while in a callback happen again by themselves, and a background save
+//   may end before or after the user edits something.
+static const ActionTraceEvent *replay_take(ActionTraceKind kind, gint code)
+{
+	if (replay == NULL)
+		return NULL;
+
+	guint n;
+	for (n = replay->next; n < replay->trace->events->len; n++)
+	{
+		ActionTraceEvent *event = REPLAY_EVENT(n);
+		if (event->kind == kind && (code < 0 || event->code == (guint) code))
+			break;
+		if (event->kind != ACTION_TRACE_EDIT)
+			return NULL;
+	}
+	if (n >= replay->trace->events->len)
+		return NULL;
+
+	if (n == replay->next)
+	{
+		replay->next++;
+		return REPLAY_EVENT(n);
+	}
+
+	// Keep edits before it to be replayed
+	g_free(replay->taken.filename);
+	replay->taken = *REPLAY_EVENT(n);
+	g_array_remove_index(replay->trace->events, n);
+	return &replay->taken;
+}
+
+static gdouble callback_start(void)
+{
+	return trace_timer != NULL ? g_timer_elapsed(trace_timer, NULL) : 0;
+}
+
+// A callback has just returned: record how long it took
+static void callback_end(Filehandler *fh, ActionTraceCallback callback, gdouble start)
+{
+	if (trace_timer == NULL)
+		return;
+
+	guint duration = (g_timer_elapsed(trace_timer, NULL) - start) * G_USEC_PER_SEC;
+	trace_event(fh, ACTION_TRACE_CALLBACK, callback, 0, duration, NULL);
+
+	if (replay != NULL)
+	{
+		ActionTraceEvent replayed = { ACTION_TRACE_CALLBACK, callback, fh->trace_id, 0, duration, NULL };
+		replay->callbacks.step(replay_take(ACTION_TRACE_CALLBACK, callback), &replayed,
+				replay->user_data);
+	}
+}
+
+// Answer of the user to a prompt or file dialog, and files chosen
+static void trace_answer(Filehandler *fh, gint answer, GSList *filenames)
+{
+	trace_event(fh, ACTION_TRACE_ANSWER, 0, answer,
+			0, filenames != NULL ? filenames->data : NULL);
+	if (filenames != NULL)
+	{
+		GSList *it;
+		for (it = filenames->next; it != NULL; it = it->next)
+			trace_event(fh, ACTION_TRACE_FILE, 0, 0, 0, it->data);
+	}
+}
+
+// Answer given when the trace was recorded. If trace went otherwise, cancel.
+static gint replay_answer(GSList **filenames)
+{
+	const ActionTraceEvent *event = replay_take(ACTION_TRACE_ANSWER, -1);
+	if (event == NULL)
+	{
+		replay->callbacks.step(NULL, NULL, replay->user_data);
+		return GTK_RESPONSE_CANCEL;
+	}
+
+	gint answer = event->value;
+	if (filenames != NULL)
+	{
+		*filenames = NULL;
+		if (event->filename != NULL)
+			*filenames = g_slist_append(*filenames, g_strdup(event->filename));
+		while ((event = replay_take(ACTION_TRACE_FILE, -1)) != NULL)
+			*filenames = g_slist_append(*filenames, g_strdup(event->filename));
+	}
+	return answer;
+}
+
+// Run a file chooser dialog, or take its answer from the trace
+//   filenames are those chosen if answer is GTK_RESPONSE_OK. A replay
+//   doesn't build the dialog, so it needs no display.
+static gint choose_files(Filehandler *fh, GtkFileChooserAction action, GSList **filenames)
+{
+	*filenames = NULL;
+	if (replay != NULL)
+	{
+		gint result = replay_answer(filenames);
+		trace_answer(fh, result, *filenames);
+		return result;
+	}
+
+	GtkWidget *dialog;
+	if (action == GTK_FILE_CHOOSER_ACTION_OPEN)
+	{
+		dialog = gtk_file_chooser_dialog_new(_("Open file..."),
+				GTK_WINDOW(fh->main_window), GTK_FILE_CHOOSER_ACTION_OPEN,
+				GTK_STOCK_OPEN, GTK_RESPONSE_OK, GTK_STOCK_CANCEL,
+				GTK_RESPONSE_CANCEL, NULL);
+		if (fh->callbacks.open_many != NULL)
+			gtk_file_chooser_set_select_multiple(GTK_FILE_CHOOSER(dialog), TRUE);
+	}
+	else
+	{
+		dialog = gtk_file_chooser_dialog_new(_("Save as..."),
+				GTK_WINDOW(fh->main_window),
+				GTK_FILE_CHOOSER_ACTION_SAVE,
+				GTK_STOCK_SAVE, GTK_RESPONSE_OK, GTK_STOCK_CANCEL,
+				GTK_RESPONSE_CANCEL, NULL);
+		gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(dialog), TRUE);
+	}
+
+	if (fh->last_dir != NULL)
+		gtk_file_chooser_set_current_folder(GTK_FILE_CHOOSER(dialog),
+				fh->last_dir);
+
+	gint result = gtk_dialog_run(GTK_DIALOG(dialog));
+	if (result == GTK_RESPONSE_OK)
+		*filenames = gtk_file_chooser_get_filenames(GTK_FILE_CHOOSER(dialog));
+	gtk_widget_destroy(dialog);
+
+	trace_answer(fh, result, *filenames);
+	return result;
+}
+
+// Show a message, or print it while replaying: a replay opens no window
+static void tell_user(Filehandler *fh, GtkMessageType type, const gchar *msg)
+{
+	if (replay != NULL)
+		g_printerr("%s\n", msg);
+	else
+		showNotification(GTK_WINDOW(fh->main_window), type, msg);
+}
+
+gboolean filehandler_record_trace(const gchar *filename, GError **error)
+{
+	if (trace_writer != NULL)
+	{
+		action_trace_writer_close(trace_writer);
+		trace_writer = NULL;
+	}
+	if (filename == NULL)
+		return TRUE;
+
+	trace_writer = action_trace_writer_new(filename, error);
+	if (trace_writer == NULL)
+		return FALSE;
+	if (trace_timer == NULL)
+		trace_timer = g_timer_new();
+	return TRUE;
+}
+
+static gboolean replay_next(gpointer data);
+
+// Go on with the replay, right after pending events or a little later
+static void replay_schedule(gboolean later)
+{
+	if (later)
+		g_timeout_add(REPLAY_POLL, replay_next, NULL);
+	else
+		g_idle_add_full(G_PRIORITY_LOW, replay_next, NULL, NULL);
+}
+
+// Give the application some time to do what trace says it did next
+//   Returns FALSE when it has waited too much.
+static gboolean replay_wait(void)
+{
+	if (!replay->is_waiting)
+	{
+		replay->is_waiting = TRUE;
+		g_timer_start(replay->waiting);
+	}
+	if (g_timer_elapsed(replay->waiting, NULL) > REPLAY_PATIENCE)
+	{
+		replay->is_waiting = FALSE;
+		return FALSE;
+	}
+	replay_schedule(TRUE);
+	return TRUE;
+}
+
+static Filehandler *find_document(guint trace_id)
+{
+	GList *it;
+	for (it = documents; it != NULL; it = it->next)
+	{
+		Filehandler *fh = it->data;
+		if (fh->trace_id == trace_id)
+			return fh;
+	}
+	return NULL;
+}
+
+static void replay_finish(void)
+{
+	Replay *done = replay;
+	replay = NULL;
+
+	if (trace_writer == NULL)
+	{
+		g_timer_destroy(trace_timer);
+		trace_timer = NULL;
+	}
+	g_timer_destroy(done->waiting);
+	g_free(done->taken.filename);
+	action_trace_free(done->trace);
+
+	if (done->callbacks.done != NULL)
+		done->callbacks.done(done->user_data);
+	g_free(done);
+}
+
+// Do the user action or edit that is next on trace
+static void replay_event(Filehandler *fh, const ActionTraceEvent *event)
+{
+	if (event->kind == ACTION_TRACE_EDIT)
+	{
+		filehandler_file_changed(fh, event->value);
+		return;
+	}
+
+	switch (event->code)
+	{
+	case ACTION_TRACE_NEW:
+		filehandler_on_action_new_activate(NULL, fh);
+		break;
+	case ACTION_TRACE_OPEN:
+		filehandler_on_action_open_activate(NULL, fh);
+		break;
+	case ACTION_TRACE_SAVE:
+		filehandler_on_action_save_activate(NULL, fh);
+		break;
+	case ACTION_TRACE_SAVE_AS:
+		filehandler_on_action_save_as_activate(NULL, fh);
+		break;
+	case ACTION_TRACE_CLOSE:
+		filehandler_on_action_close_activate(NULL, fh);
+		break;
+	case ACTION_TRACE_QUIT:
+		filehandler_on_action_quit_activate(NULL, fh);
+		break;
+	}
+}
+
+static gboolean replay_next(gpointer data)
+{
+	if (replay == NULL)
+		return FALSE;
+	if (replay->next >= replay->trace->events->len)
+	{
+		replay_finish();
+		return FALSE;
+	}
+
+	ActionTraceEvent event = *REPLAY_EVENT(replay->next);
+
+	// Answers and callbacks are taken while actions are replayed: one left
+	//   here hasn't happened yet, e.g. a background save still running.
+	if (event.kind != ACTION_TRACE_ACTION && event.kind != ACTION_TRACE_EDIT)
+	{
+		if (replay_wait())
+			return FALSE;
+		replay->callbacks.step(&event, NULL, replay->user_data);
+		replay->next++;
+		replay_schedule(FALSE);
+		return FALSE;
+	}
+
+	// A document the application may still be creating, e.g. a new window
+	Filehandler *fh = find_document(event.document);
+	if (fh == NULL && replay_wait())
+		return FALSE;
+	replay->is_waiting = FALSE;
+	replay->next++;
+
+	if (fh == NULL && replay->callbacks.new_document != NULL)
+	{
+		fh = replay->callbacks.new_document(replay->user_data);
+		if (fh != NULL)
+			fh->trace_id = event.document;
+	}
+
+	if (fh != NULL)
+		replay_event(fh, &event);
+	else
+		replay->callbacks.step(&event, NULL, replay->user_data);
+
+	replay_schedule(FALSE);
+	return FALSE;
+}
+
+void filehandler_replay_trace(ActionTrace *trace, const FilehandlerReplayCallbacks *callbacks,
+		gpointer user_data)
+{
+	g_return_if_fail(trace != NULL && callbacks != NULL && callbacks->step != NULL);
+
+	if (replay != NULL)
+	{
+		action_trace_free(trace);
+		return;
+	}
+
+	replay = g_new0(Replay, 1);
+	replay->trace = trace;
+	replay->callbacks = *callbacks;
+	replay->user_data = user_data;
+	replay->waiting = g_timer_new();
+	if (trace_timer == NULL)
+		trace_timer = g_timer_new();
+
+	replay_schedule(FALSE);
+}
+
+///////////////////////////////////
+// Memory budget
+///////////////////////////////////
+
+static gsize memory_budget = FILEHANDLER_DEFAULT_MEMORY_BUDGET;
+
+// Drop the document from memory, spilling unsaved changes to a temp file
+static gboolean hibernate_document(Filehandler *fh)
+{
+	gchar *spill_filename = NULL;
+
+	if (!fh->file_changes_saved)
+	{
+		gint fd = g_file_open_tmp("filehandler-XXXXXX", &spill_filename, NULL);
+		if (fd < 0)
+			return FALSE;
+		close(fd);
+	}
+	else if (!io_engine_get_file_id(fh->current_filename, &fh->hibernated_file))
+		return FALSE;
+
+	hibernating = TRUE;
+	gboolean done = fh->callbacks.hibernate(spill_filename, fh->user_data);
+	hibernating = FALSE;
+
+	if (!done)
+	{
+		if (spill_filename != NULL)
+			g_unlink(spill_filename);
+		g_free(spill_filename);
+		return FALSE;
+	}
+
+	fh->spill_filename = spill_filename;
+	fh->hibernated = TRUE;
+	return TRUE;
+}
+
+// Forget about hibernation, e.g. when document is closed
+static void discard_hibernation(Filehandler *fh)
+{
+	if (fh->spill_filename != NULL)
+		g_unlink(fh->spill_filename);
+	g_free(fh->spill_filename);
+	fh->spill_filename = NULL;
+	fh->hibernated = FALSE;
+}
+
+// Load back a hibernated document
+static gboolean wake_document(Filehandler *fh)
+{
+	if (!fh->hibernated)
+		return TRUE;
+
+	const gchar *filename = fh->spill_filename != NULL ? fh->spill_filename : fh->current_filename;
+	IoEngineFileId id;
+	gboolean changed_on_disk = fh->spill_filename == NULL
+			&& io_engine_get_file_id(filename, &id)
+			&& memcmp(&id, &fh->hibernated_file, sizeof(IoEngineFileId)) != 0;
+
+	hibernating = TRUE;
+	gboolean done = fh->callbacks.wake(filename, fh->user_data);
+	hibernating = FALSE;
+	if (!done)
+		return FALSE;
+
+	discard_hibernation(fh);
+
+	if (changed_on_disk)
+	{
+		gchar *msg = g_strdup_printf(_("\"%s\" was changed by another program while it was inactive. Its new contents were loaded."), fh->current_filename);
+		tell_user(fh, GTK_MESSAGE_INFO, msg);
+		g_free(msg);
+	}
+	return TRUE;
+}
+
+// Can it be dropped from memory now?
+static gboolean can_hibernate(Filehandler *fh)
+{
+	if (fh->hibernated || IS_CLOSED(fh) || fh->saving != NULL)
+		return FALSE;
+	if (fh->callbacks.hibernate == NULL || fh->callbacks.wake == NULL)
+		return FALSE;
+	// A new unchanged file has nothing to be loaded back from
+	return is_file_named(fh) || !fh->file_changes_saved;
+}
+
+// Hibernate least recently used documents until all fit in budget.
+//   The most recently used one is always kept.
+static void enforce_memory_budget(void)
+{
+	if (memory_budget == 0 || hibernating || documents == NULL)
+		return;
+
+	gsize total = 0;
+	GList *it;
+	for (it = documents; it != NULL; it = it->next)
+	{
+		Filehandler *fh = it->data;
+		if (!fh->hibernated)
+			total += fh->memory_usage;
+	}
+
+	for (it = g_list_last(documents); it != documents && total > memory_budget; it = it->prev)
+	{
+		Filehandler *fh = it->data;
+		gsize usage = fh->memory_usage;
+		if (can_hibernate(fh) && hibernate_document(fh))
+			total -= usage;
+	}
+}
+
+void filehandler_set_memory_budget(gsize bytes)
+{
+	memory_budget = bytes;
+	enforce_memory_budget();
+}
+
+void filehandler_set_memory_usage(Filehandler *fh, gsize bytes)
+{
+	if (fh == NULL)
+		return;
+	fh->memory_usage = bytes;
+	if (!fh->hibernated)
+		enforce_memory_budget();
+}
+
+void filehandler_touch(Filehandler *fh)
+{
+	if (fh == NULL)
+		return;
+
+	if (documents->data != fh)
+	{
+		documents = g_list_remove(documents, fh);
+		documents = g_list_prepend(documents, fh);
+	}
+
+	if (fh->hibernated && !wake_document(fh))
+		return;
+	enforce_memory_budget();
+}
+
+gboolean filehandler_is_hibernated(const Filehandler *fh)
+{
+	return fh != NULL && fh->hibernated;
+}
+
 ///////////////////////////////////
 // New file
 ///////////////////////////////////
@@ -133,16 +695,20 @@ void filehandler_on_action_new_activate(GtkAction *action, gpointer data)
 
 	Filehandler *fh = data;
 
+	trace_action(fh, ACTION_TRACE_NEW, NULL);
+
 	if (fh->callbacks.new == NULL)
 	{
-		showWarningMessage(GTK_WINDOW(fh->main_window), _("You aren't allowed to create a new file."));
+		tell_user(fh, GTK_MESSAGE_WARNING, _("You aren't allowed to create a new file."));
 		return;
 	}
 
 	if (!try_close_file(fh))
 		return;
 
+	gdouble start = callback_start();
 	fh->callbacks.new(fh->user_data);
+	callback_end(fh, ACTION_TRACE_CALLBACK_NEW, start);
 
 	fh->current_filename = FILENAME_NOT_SAVED;
 	fh->file_changes_saved = TRUE;
@@ -163,7 +729,10 @@ void filehandler_on_action_new_activate(GtkAction *action, gpointer data)
 //   No file must be opened on filehandler.
 static gboolean do_open_file(Filehandler *fh, const gchar *filename)
 {
-	if (! fh->callbacks.open(filename, fh->user_data))
+	gdouble start = callback_start();
+	gboolean opened = fh->callbacks.open(filename, fh->user_data);
+	callback_end(fh, ACTION_TRACE_CALLBACK_OPEN, start);
+	if (!opened)
 		return FALSE;
 
 	if (is_file_named(fh))
@@ -197,29 +766,39 @@ void filehandler_on_action_open_activate (GtkAction *action, gpointer data)
 
 	Filehandler *fh = data;
 
-	GtkWidget * dialog = gtk_file_chooser_dialog_new(_("Open file..."),
-			GTK_WINDOW(fh->main_window), GTK_FILE_CHOOSER_ACTION_OPEN,
-			GTK_STOCK_OPEN, GTK_RESPONSE_OK, GTK_STOCK_CANCEL,
-			GTK_RESPONSE_CANCEL, NULL);
-
-	if (fh->last_dir != NULL)
-		gtk_file_chooser_set_current_folder(GTK_FILE_CHOOSER(dialog),
-				fh->last_dir);
+	trace_action(fh, ACTION_TRACE_OPEN, NULL);
 
-	gint result = gtk_dialog_run(GTK_DIALOG(dialog));
+	GSList *filenames;
+	choose_files(fh, GTK_FILE_CHOOSER_ACTION_OPEN, &filenames);
+	if (filenames == NULL)
+		return;
 
-	if (result != GTK_RESPONSE_OK)
+	if (filenames->next != NULL)
 	{
-		gtk_widget_destroy(dialog);
+		// Many files: let application open them all at once
+		gchar **list = g_new0(gchar*, g_slist_length(filenames) + 1);
+		gint n = 0;
+		GSList *it;
+		for (it = filenames; it != NULL; it = it->next)
+			list[n++] = it->data;
+		g_slist_free(filenames);
+
+		g_free(fh->last_dir);
+		fh->last_dir = g_path_get_dirname(list[0]);
+
+		fh->callbacks.open_many((const gchar * const *) list, fh->user_data);
+		g_strfreev(list);
 		return;
 	}
 
-	gchar *filename;
-	filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
-	gtk_widget_destroy(dialog);
+	gchar *filename = filenames->data;
+	g_slist_free(filenames);
 
 	if (!try_close_file(fh))
+	{
+		g_free(filename);
 		return;
+	}
 
 	do_open_file(fh, filename);
 	g_free(filename);
@@ -248,15 +827,19 @@ static gboolean do_save_file(Filehandler *fh)
 {
 	if (fh->callbacks.save == NULL)
 	{
-		showWarningMessage(GTK_WINDOW(fh->main_window), _("You aren't allowed to save a file."));
+		tell_user(fh, GTK_MESSAGE_WARNING, _("You aren't allowed to save a file."));
 		return FALSE;
 	}
 
+	if (!wake_document(fh))
+		return FALSE;
+
 	// Save
-	if (! fh->callbacks.save(fh->user_data))
-	{
+	gdouble start = callback_start();
+	gboolean saved = fh->callbacks.save(fh->user_data);
+	callback_end(fh, ACTION_TRACE_CALLBACK_SAVE, start);
+	if (!saved)
 		return FALSE;
-	}
 
 	fh->file_changes_saved = TRUE;
 	if (fh->actions.save != NULL)
@@ -265,40 +848,149 @@ static gboolean do_save_file(Filehandler *fh)
 	return TRUE;
 }
 
-static gboolean do_save_as_file(Filehandler *fh)
+// A save running on a worker thread
+typedef struct {
+	Filehandler *fh;
+	gpointer snapshot;
+	gchar *filename;
+	guint change_serial;
+	gboolean written;
+	GError *error;
+	gdouble start;
+} BackgroundSave;
+
+static void start_background_save(Filehandler *fh);
+
+// Runs on main loop once the snapshot was written
+static gboolean background_save_done(gpointer data)
 {
-	if (fh->callbacks.save_as == NULL)
+	BackgroundSave *job = data;
+	Filehandler *fh = job->fh;
+
+	fh->saving = NULL;
+	callback_end(fh, ACTION_TRACE_CALLBACK_SAVE_SNAPSHOT, job->start);
+
+	// Once destroyed, its window and user_data may be freed already
+	if (fh->destroy_pending)
+		fh->callbacks.free_snapshot(job->snapshot);
+	else
 	{
-		showWarningMessage(GTK_WINDOW(fh->main_window), _("You aren't allowed to save as another file."));
-		return FALSE;
+		if (!job->written)
+			tell_user(fh, GTK_MESSAGE_ERROR, job->error->message);
+		else if (fh->change_serial == job->change_serial)
+		{
+			fh->file_changes_saved = TRUE;
+			if (fh->actions.save != NULL)
+				gtk_action_set_sensitive(fh->actions.save, FALSE);
+		}
+		else
+		{
+			// Edited meanwhile: what is on disk isn't what is being edited
+			filehandler_file_changed(fh, TRUE);
+		}
+
+		fh->callbacks.snapshot_done(job->snapshot, job->written, fh->user_data);
 	}
 
-	// Let user choose the file name
-	GtkWidget * dialog = gtk_file_chooser_dialog_new(_("Save as..."),
-			GTK_WINDOW(fh->main_window),
-			GTK_FILE_CHOOSER_ACTION_SAVE,
-			GTK_STOCK_SAVE, GTK_RESPONSE_OK, GTK_STOCK_CANCEL,
-			GTK_RESPONSE_CANCEL, NULL);
+	if (job->error != NULL)
+		g_error_free(job->error);
+	g_free(job->filename);
+	g_free(job);
 
-	if (fh->last_dir != NULL)
-		gtk_file_chooser_set_current_folder(GTK_FILE_CHOOSER(dialog),
-				fh->last_dir);
+	if (fh->destroy_pending)
+		filehandler_destroy(fh);
+	else if (fh->save_again)
+		start_background_save(fh);
+	return FALSE;
+}
 
-	gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(dialog), TRUE);
+// Runs on a worker thread
+static void background_save_run(gpointer data, gpointer pool_data)
+{
+	BackgroundSave *job = data;
+	Filehandler *fh = job->fh;
 
-	gint result = gtk_dialog_run(GTK_DIALOG(dialog));
+	job->written = fh->callbacks.save_snapshot(job->snapshot, job->filename, &job->error);
+	if (!job->written && job->error == NULL)
+		g_set_error(&job->error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+				_("Couldn't save \"%s\"."), job->filename);
 
-	// User gave up?
-	if (result != GTK_RESPONSE_OK)
+	g_idle_add(background_save_done, job);
+}
+
+static void start_background_save(Filehandler *fh)
+{
+	static GThreadPool *pool = NULL;
+
+	// Only one at a time; the last request is done after the current one
+	fh->save_again = fh->saving != NULL;
+	if (fh->saving != NULL)
+		return;
+
+	if (!wake_document(fh))
+		return;
+
+	if (pool == NULL)
 	{
-		gtk_widget_destroy(dialog);
+#if !GLIB_CHECK_VERSION(2,32,0)
+		if (!g_thread_supported())
+			g_thread_init(NULL);
+#endif
+		pool = g_thread_pool_new(background_save_run, NULL, -1, FALSE, NULL);
+	}
+
+	BackgroundSave *job = g_new0(BackgroundSave, 1);
+	job->fh = fh;
+	job->filename = g_strdup(fh->current_filename);
+	job->change_serial = fh->change_serial;
+	job->start = callback_start();
+	job->snapshot = fh->callbacks.snapshot(fh->user_data);
+	fh->saving = job;
+
+	g_thread_pool_push(pool, job, NULL);
+}
+
+// Save in background if the application allows it
+static gboolean can_save_in_background(Filehandler *fh)
+{
+	return fh->callbacks.snapshot != NULL && fh->callbacks.save_snapshot != NULL
+			&& fh->callbacks.snapshot_done != NULL && fh->callbacks.free_snapshot != NULL;
+}
+
+// Wait until a background save is done
+//   Main loop keeps running meanwhile: the document can't be closed then.
+static void wait_background_save(Filehandler *fh)
+{
+	gboolean busy = fh->busy;
+	fh->busy = TRUE;
+	fh->save_again = FALSE;
+	while (fh->saving != NULL)
+		g_main_context_iteration(NULL, TRUE);
+	fh->busy = busy;
+}
+
+static gboolean do_save_as_file(Filehandler *fh)
+{
+	if (fh->callbacks.save_as == NULL)
+	{
+		tell_user(fh, GTK_MESSAGE_WARNING, _("You aren't allowed to save as another file."));
 		return FALSE;
 	}
 
-	gchar *filename;
-	filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
-	gtk_widget_destroy(dialog);
+	// Let user choose the file name
+	GSList *filenames;
+	choose_files(fh, GTK_FILE_CHOOSER_ACTION_SAVE, &filenames);
+
+	// User gave up?
+	if (filenames == NULL)
+		return FALSE;
 
+	gchar *filename = filenames->data;
+	g_slist_foreach(filenames->next, (GFunc) g_free, NULL);
+	g_slist_free(filenames);
+
+	// A save going on in background would finish after this one
+	wait_background_save(fh);
 
 	// It's an overwrite?
 	if (g_strcmp0(filename, fh->current_filename) == 0)
@@ -311,7 +1003,10 @@ static gboolean do_save_as_file(Filehandler *fh)
 
 	// It's a real Save As
 	// Finally save
-	if ( !fh->callbacks.save_as(filename, fh->user_data))
+	gdouble start = callback_start();
+	gboolean saved = wake_document(fh) && fh->callbacks.save_as(filename, fh->user_data);
+	callback_end(fh, ACTION_TRACE_CALLBACK_SAVE_AS, start);
+	if (!saved)
 	{
 		g_free(filename);
 		return FALSE;
@@ -350,6 +1045,7 @@ void filehandler_on_action_save_as_activate(GtkAction *action, gpointer data)
 	if (IS_CLOSED(fh))
 		return;
 
+	trace_action(fh, ACTION_TRACE_SAVE_AS, NULL);
 	do_save_as_file(fh);
 
 }
@@ -369,7 +1065,11 @@ void filehandler_on_action_save_activate(GtkAction *action, gpointer data)
 		return;
 	}
 
-	do_save_file(fh);
+	trace_action(fh, ACTION_TRACE_SAVE, NULL);
+	if (can_save_in_background(fh))
+		start_background_save(fh);
+	else
+		do_save_file(fh);
 }
 
 // Save the current file.
@@ -385,7 +1085,10 @@ gboolean filehandler_save_file (Filehandler *fh)
 	if (!is_file_named(fh))
 		return FALSE;
 
-	do_save_file(fh);
+	if (can_save_in_background(fh))
+		start_background_save(fh);
+	else
+		do_save_file(fh);
 
 	return TRUE;
 }
@@ -402,12 +1105,16 @@ void filehandler_on_action_close_activate(GtkAction *action, gpointer data)
 		return;
 
 	Filehandler *fh = data;
+	trace_action(fh, ACTION_TRACE_CLOSE, NULL);
 	try_close_file(fh);
 }
 
 static void do_close_file(Filehandler *fh)
 {
+	gdouble start = callback_start();
 	fh->callbacks.close(fh->user_data);
+	callback_end(fh, ACTION_TRACE_CALLBACK_CLOSE, start);
+	discard_hibernation(fh);
 	// FIXME: And if it should support multiple files (tabs or windows)?
 	//          close() callback shouldn't destroy Filehandler structure?
 	if (is_file_named(fh))
@@ -424,10 +1131,123 @@ static void do_close_file(Filehandler *fh)
 
 }
 
+// Time for finding the shortest diff, in milliseconds
+#define DIFF_TIME_BUDGET 50
+
+// Changes shown in the prompt about unsaved changes
+typedef struct {
+	Filehandler *fh;
+	GtkTextBuffer *buffer;
+	TextDiff *diff;
+	gboolean any;
+} ChangesView;
+
+static void changes_view_append(ChangesView *view, const gchar *text, gsize length, const gchar *tag)
+{
+	GtkTextIter end;
+	gtk_text_buffer_get_end_iter(view->buffer, &end);
+	gtk_text_buffer_insert_with_tags_by_name(view->buffer, &end, text, length, "diff", tag, NULL);
+}
+
+static void on_diff_hunk(const gchar *hunk, gpointer data)
+{
+	ChangesView *view = data;
+	const gchar *line = hunk;
+
+	view->any = TRUE;
+	while (*line != '\0')
+	{
+		const gchar *next = strchr(line, '\n');
+		next = next != NULL ? next + 1 : line + strlen(line);
+
+		const gchar *tag = NULL;
+		if (*line == '+')
+			tag = "added";
+		else if (*line == '-')
+			tag = "removed";
+		else if (*line == '@')
+			tag = "hunk";
+		changes_view_append(view, line, next - line, tag);
+		line = next;
+	}
+}
+
+static void on_diff_done(gboolean complete, gpointer data)
+{
+	ChangesView *view = data;
+
+	if (!complete)
+		changes_view_append(view, _("(Not all changes could be shown.)"), -1, "hunk");
+	else if (!view->any)
+		changes_view_append(view, _("(No changes.)"), -1, "hunk");
+}
+
+// Diff is only done if the user wants to see it
+static void on_changes_view_map(GtkWidget *widget, gpointer data)
+{
+	ChangesView *view = data;
+	if (view->diff != NULL || !wake_document(view->fh))
+		return;
+
+	gsize length = 0;
+	gchar *text = view->fh->callbacks.contents(&length, view->fh->user_data);
+	if (text == NULL)
+		return;
+	view->diff = text_diff_start(view->fh->current_filename, text, length,
+			DIFF_TIME_BUDGET, on_diff_hunk, on_diff_done, view);
+}
+
+// Ask if unsaved changes should be saved, letting the user see them
+static gint run_save_prompt(Filehandler *fh)
+{
+	const gchar *msg = _("There are unsaved changes.\nDo you want to save them before close this file?");
+
+	if (!is_file_named(fh) || fh->callbacks.contents == NULL)
+		return showYesNoCancelDialog(GTK_WINDOW(fh->main_window), msg);
+
+	ChangesView view = { fh, gtk_text_buffer_new(NULL), NULL, FALSE };
+	gtk_text_buffer_create_tag(view.buffer, "diff", "family", "monospace", NULL);
+	gtk_text_buffer_create_tag(view.buffer, "added", "foreground", "dark green", NULL);
+	gtk_text_buffer_create_tag(view.buffer, "removed", "foreground", "dark red", NULL);
+	gtk_text_buffer_create_tag(view.buffer, "hunk", "foreground", "gray50", NULL);
+
+	GtkWidget *textview = gtk_text_view_new_with_buffer(view.buffer);
+	gtk_text_view_set_editable(GTK_TEXT_VIEW(textview), FALSE);
+	GtkWidget *scrolled = gtk_scrolled_window_new(NULL, NULL);
+	gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled),
+			GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+	gtk_widget_set_size_request(scrolled, 480, 240);
+	gtk_container_add(GTK_CONTAINER(scrolled), textview);
+	g_signal_connect(scrolled, "map", G_CALLBACK(on_changes_view_map), &view);
+
+	gint result = showYesNoCancelDialogWithDetails(GTK_WINDOW(fh->main_window), msg,
+			_("Show _changes"), scrolled);
+
+	text_diff_cancel(view.diff);
+	g_object_unref(view.buffer);
+	return result;
+}
+
+// Ask it, or take the answer from the trace being replayed
+static gint ask_to_save(Filehandler *fh)
+{
+	gint result;
+
+	if (replay != NULL)
+		result = replay_answer(NULL);
+	else
+		result = run_save_prompt(fh);
+
+	trace_answer(fh, result, NULL);
+	return result;
+}
+
 // If the file is saved, close it.
 //   Otherwise, ask the user what to do: discard changes, save them or don't close it.
-static gboolean try_close_file(Filehandler *fh)
+static gboolean close_file(Filehandler *fh)
 {
+	wait_background_save(fh);
+
 	if (!fh->file_changes_saved)
 	{
 		// Ask if it should be saved, discarded or cancelled
@@ -439,8 +1259,7 @@ static gboolean try_close_file(Filehandler *fh)
 
 		if (save_func != NULL)
 		{
-			gint result = showYesNoCancelDialog(GTK_WINDOW(fh->main_window),
-					_("There are unsaved changes.\nDo you want to save them before close this file?"));
+			gint result = ask_to_save(fh);
 			if (result == GTK_RESPONSE_CANCEL)
 				return FALSE;
 			if (result == GTK_RESPONSE_YES)
@@ -458,14 +1277,31 @@ static gboolean try_close_file(Filehandler *fh)
 	return TRUE;
 }
 
+// Close it, unless it's being closed already: waiting for a save or asking
+//   the user let main loop run, so another close may come meanwhile.
+static gboolean try_close_file(Filehandler *fh)
+{
+	if (fh->busy)
+		return FALSE;
+
+	fh->busy = TRUE;
+	gboolean closed = close_file(fh);
+	fh->busy = FALSE;
+	return closed;
+}
+
 ///////////////////////////////////
 // Exit
 ///////////////////////////////////
 
 static void exit_program(Filehandler *fh)
 {
-	gtk_widget_destroy(fh->main_window);
-	gtk_main_quit();
+	if (fh->main_window != NULL)
+		gtk_widget_destroy(fh->main_window);
+	if (fh->callbacks.quit != NULL)
+		fh->callbacks.quit(fh->user_data);
+	else
+		gtk_main_quit();
 }
 
 G_MODULE_EXPORT
@@ -477,6 +1313,7 @@ gboolean filehandler_on_main_window_delete_event(GtkWidget *widget,
 
 	Filehandler *fh = data;
 
+	trace_action(fh, ACTION_TRACE_QUIT, NULL);
 	if (try_close_file(fh))
 	{
 		exit_program(fh);
@@ -494,6 +1331,7 @@ void filehandler_on_action_quit_activate(GtkAction *action, gpointer data)
 
 	Filehandler *fh = data;
 
+	trace_action(fh, ACTION_TRACE_QUIT, NULL);
 	if (try_close_file(fh))
 		exit_program(fh);
 }
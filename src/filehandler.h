@@ -24,13 +24,42 @@
 
 #include "gtk/gtk.h"
 
+#include "action_trace.h"
+#include "io_engine.h"
+
 // These are Filehandler callbacks
 //   Filehandler calls them when the user really wants to do some action.
 //   If a function should not be used at all, set it as NULL pointer.
+//   Callbacks are added over time, so zero-initialize the whole structure
+//   (e.g. FilehandlerCallbacks cb = { 0 };) before setting those you use.
 //   user_data is the data passed to the Filehandler structure.
 //   If the operations "open", "save" and "save as" can't be done, they should
 //   return FALSE and tell it to user. Otherwise, if they're successful, make
 //   them return TRUE instead.
+//   If "open_many" is set, the open dialog lets the user choose several files
+//   at once. When more than one is chosen, all of them are given to it (as a
+//   NULL-terminated array) instead of "open", and the current file is kept
+//   untouched: it's up to the application where to open them.
+//   If "quit" is set, it's called instead of leaving GTK main loop when the
+//   main window was closed, e.g., if the application has other windows.
+//   If "snapshot", "save_snapshot", "snapshot_done" and "free_snapshot" are
+//   all set, "Save" doesn't freeze the document: "snapshot" takes a cheap
+//   copy of it, which "save_snapshot" writes on a worker thread (so it must
+//   not touch GTK+ nor user_data) while the user keeps editing. Then
+//   "snapshot_done" is called back on main loop to free it; written tells if
+//   it was saved. If the Filehandler was destroyed meanwhile, user_data may
+//   be gone: "free_snapshot" is called instead, and must only free it.
+//   If the document was changed meanwhile, it's still marked as changed.
+//   Closing a document always uses "save", and waits any background save.
+//   If "hibernate" and "wake" are set, the document may be dropped from
+//   memory while it isn't used, when all documents together go beyond the
+//   memory budget (see filehandler_set_memory_budget()). If it has unsaved
+//   changes, "hibernate" gets a spill_filename where to write them first.
+//   "wake" must load the document back from filename: the spill file, or
+//   the document file itself.
+//   If "contents" is set, the prompt about unsaved changes can show what
+//   changed since the file was saved. It returns a copy of the document text
+//   (freed with g_free()) and its length.
 typedef struct {
 	void (*new)(gpointer user_data);
 	gboolean (*open)(const gchar *filename, gpointer user_data);
@@ -38,6 +67,15 @@ typedef struct {
 	gboolean (*save_as)(const gchar *filename, gpointer user_data);
 	void (*close)(gpointer user_data);
 	void (*include_in_recents)(const gchar *filename, gpointer user_data);
+	void (*open_many)(const gchar * const *filenames, gpointer user_data);
+	void (*quit)(gpointer user_data);
+	gpointer (*snapshot)(gpointer user_data);
+	gboolean (*save_snapshot)(gpointer snapshot, const gchar *filename, GError **error);
+	void (*snapshot_done)(gpointer snapshot, gboolean written, gpointer user_data);
+	void (*free_snapshot)(gpointer snapshot);
+	gboolean (*hibernate)(const gchar *spill_filename, gpointer user_data);
+	gboolean (*wake)(const gchar *filename, gpointer user_data);
+	gchar *(*contents)(gsize *length, gpointer user_data);
 } FilehandlerCallbacks;
 
 // A set of GtkAction used by the GUI for file handling.
@@ -59,6 +97,25 @@ typedef struct {
 	gchar *last_dir;
 	GtkWidget *main_window;
 
+	// Background save state
+	guint change_serial;
+	gpointer saving;
+	gboolean save_again;
+	gboolean destroy_pending;
+	// Waiting for a background save, or asking whether to save before
+	//   closing: main loop runs meanwhile, but other closes are refused
+	gboolean busy;
+
+	// Memory budget state
+	gsize memory_usage;
+	gboolean hibernated;
+	gchar *spill_filename;
+	// What its file was when it was dropped, if it had no unsaved changes
+	IoEngineFileId hibernated_file;
+
+	// Which document it is in action traces
+	guint trace_id;
+
 	gpointer user_data;
 
 	FilehandlerCallbacks callbacks;
@@ -79,6 +136,10 @@ const gchar *filehandler_get_filename(const Filehandler *fh);
 // Get the name of the last chosen directory
 const gchar *filehandler_get_directory(const Filehandler *fh);
 
+// Set the directory where file dialogs start browsing,
+//   e.g., one remembered from a previous session.
+void filehandler_set_directory(Filehandler *fh, const gchar *dirname);
+
 // Tell Filehandler that the file has been changed.
 //   You should really use this, as based on this information,
 //   the user will be asked or not if he wants to save/close the file
@@ -89,6 +150,48 @@ void filehandler_file_changed(Filehandler *fh, gboolean changed);
 void filehandler_update_action_status(const Filehandler *fh);
 
 
+// Memory all documents may take together before the least recently used
+//   ones are hibernated. 0 means no limit.
+#define FILEHANDLER_DEFAULT_MEMORY_BUDGET (256 * 1024 * 1024)
+void filehandler_set_memory_budget(gsize bytes);
+
+// Tell Filehandler about how much memory the document takes
+void filehandler_set_memory_usage(Filehandler *fh, gsize bytes);
+
+// Tell Filehandler the document is being used, e.g. its window got focus.
+//   If it was hibernated, it's waken up.
+void filehandler_touch(Filehandler *fh);
+
+gboolean filehandler_is_hibernated(const Filehandler *fh);
+
+
+// Record file actions of every Filehandler to a trace file (see
+//   action_trace.h), until it's called with NULL filename.
+gboolean filehandler_record_trace(const gchar *filename, GError **error);
+
+// Used while replaying a trace
+//   "new_document" must give a new Filehandler for a document that the
+//   trace has but the application didn't create by itself.
+//   "step" is called for each application callback recorded in trace:
+//   replayed is what happened now. Any of them is NULL if the replay went
+//   differently from the trace.
+typedef struct {
+	Filehandler *(*new_document)(gpointer user_data);
+	void (*step)(const ActionTraceEvent *recorded, const ActionTraceEvent *replayed,
+			gpointer user_data);
+	void (*done)(gpointer user_data);
+} FilehandlerReplayCallbacks;
+
+// Do again the actions of a trace, one per main loop iteration, without
+//   asking the user: answers to prompts and file dialogs come from trace.
+//   Edits only mark documents as changed. trace is freed when done.
+//   No dialog is built and messages are printed to stderr instead, so
+//   documents created without a main window (NULL) and with a "quit"
+//   callback replay without GTK+ being initialized, i.e. without display.
+void filehandler_replay_trace(ActionTrace *trace, const FilehandlerReplayCallbacks *callbacks,
+		gpointer user_data);
+
+
 // Open a file without user choose which one through a file browser dialog,
 //   e.g., a file picked on a recent file list.
 //   The user will be asked if he accepts close the current file.
@@ -98,7 +201,7 @@ gboolean filehandler_open_file (Filehandler *fh, const gchar *filename);
 
 // Save the current file.
 //   This can be used for autosaving.
-// Returns TRUE if the file was saved.
+// Returns TRUE if the file was saved, or started being saved in background.
 //   If the file has not a name (e.g, a new file), it will return FALSE.
 gboolean filehandler_save_file (Filehandler *fh);
 
@@ -0,0 +1,822 @@
+/*
+ * Copyright © 2011 Rodolfo Ribeiro Gomes <rodolforg arr0ba gmail.com>
+ *
+ * A file handler for GTK+
+ *
+    This file is part of GtkFileHandler.
+
+    GtkFileHandler is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GtkFileHandler is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GtkFileHandler.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "io_engine.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef G_OS_UNIX
+#include <unistd.h>
+#endif
+
+#include <glib/gi18n.h>
+#include <glib/gstdio.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+///////////////////////////////////
+// For internal use
+///////////////////////////////////
+
+// Size of each transfer; files up to it are done in a single call
+#define IO_CHUNK_SIZE (1024 * 1024)
+// Transfers in flight at once
+#define IO_QUEUE_DEPTH 32
+
+static volatile gint requested_backend = IO_ENGINE_AUTO;
+static volatile gint uring_unavailable = FALSE;
+
+static void set_errno_error(GError **error, gint err_no, const gchar *format,
+		const gchar *filename)
+{
+	gchar *display_name = g_filename_display_name(filename);
+	g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err_no),
+			format, display_name, g_strerror(err_no));
+	g_free(display_name);
+}
+
+static void get_file_id(const struct stat *st, IoEngineFileId *id)
+{
+	id->device = st->st_dev;
+	id->inode = st->st_ino;
+#ifdef G_OS_UNIX
+	id->mtime = (gint64) st->st_mtim.tv_sec * G_GINT64_CONSTANT(1000000000)
+			+ st->st_mtim.tv_nsec;
+#else
+	id->mtime = (gint64) st->st_mtime * G_GINT64_CONSTANT(1000000000);
+#endif
+	id->size = st->st_size;
+}
+
+// Transfers, patches and their logs use POSIX calls (pread(), pwrite(),
+//   fsync()...). Elsewhere, files are read and written whole by GLib.
+#ifdef G_OS_UNIX
+
+// Transfer a range with plain calls, retrying on short transfers.
+//   Returns 0 or errno. For reads, *done tells how much was read before EOF.
+static gint transfer_sync(gint fd, gchar *buf, gsize len, goffset offset,
+		gboolean write_it, gsize *done)
+{
+	gsize total = 0;
+	while (total < len)
+	{
+		gssize n = write_it ? pwrite(fd, buf + total, len - total, offset + total)
+				: pread(fd, buf + total, len - total, offset + total);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		if (n == 0)
+			break;
+		total += n;
+	}
+	if (done != NULL)
+		*done = total;
+	return (total < len && write_it) ? EIO : 0;
+}
+
+// Result of transferring chunks: first error and where EOF was found
+typedef struct {
+	gint err_no;
+	gsize length;
+} TransferResult;
+
+static void chunk_done(TransferResult *result, goffset offset, gsize len,
+		gsize done, gint err_no)
+{
+	if (err_no != 0 && result->err_no == 0)
+		result->err_no = err_no;
+	if (done < len && (gsize) offset + done < result->length)
+		result->length = offset + done;
+}
+
+///////////////////////////////////
+// Thread pool backend
+///////////////////////////////////
+
+typedef struct {
+	gint fd;
+	gchar *buf;
+	gsize len;
+	goffset offset;
+	gboolean write_it;
+	gsize done;
+	gint err_no;
+	GAsyncQueue *finished;
+} IoChunk;
+
+G_LOCK_DEFINE_STATIC(pool);
+static GThreadPool *io_pool = NULL;
+
+static void run_chunk(gpointer data, gpointer pool_data)
+{
+	IoChunk *chunk = data;
+	chunk->err_no = transfer_sync(chunk->fd, chunk->buf, chunk->len, chunk->offset,
+			chunk->write_it, &chunk->done);
+	g_async_queue_push(chunk->finished, chunk);
+}
+
+static GThreadPool *get_pool(void)
+{
+	G_LOCK(pool);
+	if (io_pool == NULL)
+	{
+#if !GLIB_CHECK_VERSION(2,32,0)
+		if (!g_thread_supported())
+			g_thread_init(NULL);
+#endif
+		io_pool = g_thread_pool_new(run_chunk, NULL, IO_QUEUE_DEPTH, FALSE, NULL);
+	}
+	G_UNLOCK(pool);
+	return io_pool;
+}
+
+static void transfer_threads(gint fd, gchar *buf, gsize size, gboolean write_it,
+		TransferResult *result)
+{
+	guint n_chunks = (size + IO_CHUNK_SIZE - 1) / IO_CHUNK_SIZE;
+	IoChunk *chunks = g_new0(IoChunk, n_chunks);
+	GAsyncQueue *finished = g_async_queue_new();
+	GThreadPool *pool = get_pool();
+	guint n;
+
+	for (n = 0; n < n_chunks; n++)
+	{
+		chunks[n].fd = fd;
+		chunks[n].offset = (goffset) n * IO_CHUNK_SIZE;
+		chunks[n].buf = buf + chunks[n].offset;
+		chunks[n].len = MIN(IO_CHUNK_SIZE, size - chunks[n].offset);
+		chunks[n].write_it = write_it;
+		chunks[n].finished = finished;
+		g_thread_pool_push(pool, &chunks[n], NULL);
+	}
+
+	for (n = 0; n < n_chunks; n++)
+	{
+		IoChunk *chunk = g_async_queue_pop(finished);
+		chunk_done(result, chunk->offset, chunk->len, chunk->done, chunk->err_no);
+	}
+
+	g_async_queue_unref(finished);
+	g_free(chunks);
+}
+
+///////////////////////////////////
+// io_uring backend
+///////////////////////////////////
+
+#ifdef HAVE_LIBURING
+
+// Queue a transfer of chunk n
+static void prep_chunk(struct io_uring *ring, gint fd, gchar *buf, gsize size,
+		guint n, gboolean write_it, gboolean registered, gboolean link)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+	goffset offset = (goffset) n * IO_CHUNK_SIZE;
+	gsize len = MIN(IO_CHUNK_SIZE, size - offset);
+
+	if (registered && write_it)
+		io_uring_prep_write_fixed(sqe, fd, buf + offset, len, offset, 0);
+	else if (registered)
+		io_uring_prep_read_fixed(sqe, fd, buf + offset, len, offset, 0);
+	else if (write_it)
+		io_uring_prep_write(sqe, fd, buf + offset, len, offset);
+	else
+		io_uring_prep_read(sqe, fd, buf + offset, len, offset);
+
+	if (link)
+		io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+	io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(n + 1));
+}
+
+// Wait for a completion. Short transfers are finished synchronously.
+//   Returns FALSE if it was a fsync cancelled because the write linked to
+//   it was short or failed: the fsync is still to be done.
+static gboolean reap_chunk(struct io_uring *ring, gint fd, gchar *buf, gsize size,
+		gboolean write_it, TransferResult *result)
+{
+	struct io_uring_cqe *cqe;
+	gint ret;
+	do
+		ret = io_uring_wait_cqe(ring, &cqe);
+	while (ret == -EINTR);
+	if (ret < 0)
+	{
+		chunk_done(result, 0, 0, 0, -ret);
+		return TRUE;
+	}
+
+	guint n = GPOINTER_TO_UINT(io_uring_cqe_get_data(cqe));
+	gint res = cqe->res;
+	io_uring_cqe_seen(ring, cqe);
+
+	// The fsync, maybe linked to last write
+	if (n == 0)
+	{
+		if (res == -ECANCELED)
+			return FALSE;
+		if (res < 0)
+			chunk_done(result, 0, 0, 0, -res);
+		return TRUE;
+	}
+
+	goffset offset = (goffset) (n - 1) * IO_CHUNK_SIZE;
+	gsize len = MIN(IO_CHUNK_SIZE, size - offset);
+	if (res < 0)
+	{
+		chunk_done(result, offset, len, 0, -res);
+		return TRUE;
+	}
+
+	gsize done = res;
+	gint err_no = 0;
+	if (done < len && res > 0)
+	{
+		gsize more = 0;
+		err_no = transfer_sync(fd, buf + offset + done, len - done,
+				offset + done, write_it, &more);
+		done += more;
+	}
+	else if (done < len && write_it)
+		err_no = EIO;
+	chunk_done(result, offset, len, done, err_no);
+	return TRUE;
+}
+
+// Queue a fsync, to be done after the write before it if link
+static void prep_fsync(struct io_uring *ring, gint fd)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+	io_uring_prep_fsync(sqe, fd, 0);
+	// user_data 0 identifies the fsync; prep doesn't clear it everywhere
+	io_uring_sqe_set_data(sqe, NULL);
+}
+
+// Returns FALSE if io_uring can't be used, so nothing was done.
+//   If sync_it, data is flushed to disk by a fsync linked to last write.
+static gboolean transfer_uring(gint fd, gchar *buf, gsize size, gboolean write_it,
+		gboolean sync_it, TransferResult *result)
+{
+	struct io_uring ring;
+	gint ret = io_uring_queue_init(IO_QUEUE_DEPTH, &ring, 0);
+	if (ret < 0)
+	{
+		if (ret == -ENOSYS || ret == -EPERM || ret == -EINVAL)
+			g_atomic_int_set(&uring_unavailable, TRUE);
+		return FALSE;
+	}
+
+	// Pin the buffer, so kernel doesn't map it on each transfer
+	struct iovec iov = { buf, size };
+	gboolean registered = io_uring_register_buffers(&ring, &iov, 1) == 0;
+
+	guint n_chunks = (size + IO_CHUNK_SIZE - 1) / IO_CHUNK_SIZE;
+	// When syncing, last write goes alone, after all others are done
+	guint n_batched = (write_it && sync_it) ? n_chunks - 1 : n_chunks;
+	guint submitted = 0, in_flight = 0;
+
+	while (submitted < n_batched || in_flight > 0)
+	{
+		while (submitted < n_batched && in_flight < IO_QUEUE_DEPTH)
+		{
+			prep_chunk(&ring, fd, buf, size, submitted++, write_it, registered, FALSE);
+			in_flight++;
+		}
+		io_uring_submit(&ring);
+		reap_chunk(&ring, fd, buf, size, write_it, result);
+		in_flight--;
+	}
+
+	if (write_it && sync_it && result->err_no == 0)
+	{
+		prep_chunk(&ring, fd, buf, size, n_chunks - 1, TRUE, registered, TRUE);
+		prep_fsync(&ring, fd);
+		io_uring_submit(&ring);
+		gboolean synced = reap_chunk(&ring, fd, buf, size, TRUE, result);
+		synced = reap_chunk(&ring, fd, buf, size, TRUE, result) && synced;
+
+		// A short last write breaks the link: once its rest is written,
+		//   sync on its own
+		if (!synced && result->err_no == 0)
+		{
+			prep_fsync(&ring, fd);
+			io_uring_submit(&ring);
+			reap_chunk(&ring, fd, buf, size, TRUE, result);
+		}
+	}
+
+	if (registered)
+		io_uring_unregister_buffers(&ring);
+	io_uring_queue_exit(&ring);
+	return TRUE;
+}
+
+#endif // HAVE_LIBURING
+
+#endif // G_OS_UNIX
+
+///////////////////////////////////
+// Backend selection
+///////////////////////////////////
+
+void io_engine_set_backend(IoEngineBackend backend)
+{
+	g_atomic_int_set(&requested_backend, backend);
+}
+
+IoEngineBackend io_engine_get_backend(void)
+{
+#ifdef HAVE_LIBURING
+	if (g_atomic_int_get(&requested_backend) != IO_ENGINE_THREADS
+			&& !g_atomic_int_get(&uring_unavailable))
+		return IO_ENGINE_URING;
+#endif
+	return IO_ENGINE_THREADS;
+}
+
+#ifdef G_OS_UNIX
+
+// Transfer a whole buffer with the chosen backend. Returns 0 or errno.
+//   For reads, *length is shortened if EOF comes earlier.
+static gint transfer(gint fd, gchar *buf, gsize *length, gboolean write_it)
+{
+	TransferResult result = { 0, *length };
+	gboolean synced = FALSE;
+
+	if (*length <= IO_CHUNK_SIZE)
+	{
+		gsize done = 0;
+		result.err_no = transfer_sync(fd, buf, *length, 0, write_it, &done);
+		result.length = done;
+	}
+#ifdef HAVE_LIBURING
+	else if (io_engine_get_backend() == IO_ENGINE_URING
+			&& transfer_uring(fd, buf, *length, write_it, TRUE, &result))
+		synced = write_it;
+#endif
+	else
+		transfer_threads(fd, buf, *length, write_it, &result);
+
+	if (write_it && !synced && result.err_no == 0 && fsync(fd) != 0)
+		result.err_no = errno;
+
+	*length = result.length;
+	return result.err_no;
+}
+
+///////////////////////////////////
+// Redo log of in-place patches
+///////////////////////////////////
+
+// Log layout, integers in little endian:
+//   "FHRL", version (u32), device (u64) and inode (u64) of the file,
+//   old length (u64), new length (u64), ranges (u32),
+//   each range as offset (u64), length (u64) and its data,
+//   then SHA-1 of all that, so a log cut short by a crash is ignored.
+#define REDO_MAGIC "FHRL"
+#define REDO_VERSION 2
+#define REDO_HEADER_SIZE (4 + 4 + 8 + 8 + 8 + 8 + 4)
+#define REDO_DIGEST_SIZE 20
+
+// The log of filename: a hidden file next to it
+static gchar *redo_log_name(const gchar *filename)
+{
+	gchar *dirname = g_path_get_dirname(filename);
+	gchar *basename = g_path_get_basename(filename);
+	gchar *logname = g_strdup_printf(".%s.redo", basename);
+	gchar *path = g_build_filename(dirname, logname, NULL);
+	g_free(logname);
+	g_free(basename);
+	g_free(dirname);
+	return path;
+}
+
+static void append_u32(GString *log, guint32 value)
+{
+	value = GUINT32_TO_LE(value);
+	g_string_append_len(log, (const gchar *) &value, sizeof(value));
+}
+
+static void append_u64(GString *log, guint64 value)
+{
+	value = GUINT64_TO_LE(value);
+	g_string_append_len(log, (const gchar *) &value, sizeof(value));
+}
+
+static guint32 read_u32(const gchar **pos)
+{
+	guint32 value;
+	memcpy(&value, *pos, sizeof(value));
+	*pos += sizeof(value);
+	return GUINT32_FROM_LE(value);
+}
+
+static guint64 read_u64(const gchar **pos)
+{
+	guint64 value;
+	memcpy(&value, *pos, sizeof(value));
+	*pos += sizeof(value);
+	return GUINT64_FROM_LE(value);
+}
+
+static void get_digest(const gchar *data, gsize length, guint8 *digest)
+{
+	gsize digest_size = REDO_DIGEST_SIZE;
+	GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA1);
+	g_checksum_update(checksum, (const guchar *) data, length);
+	g_checksum_get_digest(checksum, digest, &digest_size);
+	g_checksum_free(checksum);
+}
+
+static GString *build_redo_log(const IoEngineRange *ranges, guint n_ranges,
+		const IoEngineFileId *old, gsize length)
+{
+	GString *log = g_string_new(REDO_MAGIC);
+	guint n;
+
+	append_u32(log, REDO_VERSION);
+	append_u64(log, old->device);
+	append_u64(log, old->inode);
+	append_u64(log, old->size);
+	append_u64(log, length);
+	append_u32(log, n_ranges);
+	for (n = 0; n < n_ranges; n++)
+	{
+		append_u64(log, ranges[n].offset);
+		append_u64(log, ranges[n].length);
+		g_string_append_len(log, ranges[n].data, ranges[n].length);
+	}
+
+	guint8 digest[REDO_DIGEST_SIZE];
+	get_digest(log->str, log->len, digest);
+	g_string_append_len(log, (const gchar *) digest, REDO_DIGEST_SIZE);
+	return log;
+}
+
+// Returns FALSE if log is not complete. Range data points into log.
+//   Modification time of old isn't logged: patching changes it.
+static gboolean parse_redo_log(const gchar *log, gsize size, GArray **ranges,
+		IoEngineFileId *old, gsize *length)
+{
+	if (size < REDO_HEADER_SIZE + REDO_DIGEST_SIZE || memcmp(log, REDO_MAGIC, 4) != 0)
+		return FALSE;
+
+	guint8 digest[REDO_DIGEST_SIZE];
+	get_digest(log, size - REDO_DIGEST_SIZE, digest);
+	if (memcmp(digest, log + size - REDO_DIGEST_SIZE, REDO_DIGEST_SIZE) != 0)
+		return FALSE;
+
+	const gchar *pos = log + 4;
+	const gchar *end = log + size - REDO_DIGEST_SIZE;
+	if (read_u32(&pos) != REDO_VERSION)
+		return FALSE;
+	old->device = read_u64(&pos);
+	old->inode = read_u64(&pos);
+	old->mtime = 0;
+	old->size = read_u64(&pos);
+	*length = read_u64(&pos);
+	guint32 n_ranges = read_u32(&pos);
+
+	*ranges = g_array_new(FALSE, FALSE, sizeof(IoEngineRange));
+	while (n_ranges-- > 0)
+	{
+		IoEngineRange range;
+		if ((gsize) (end - pos) < 16)
+			break;
+		range.offset = read_u64(&pos);
+		range.length = read_u64(&pos);
+		if ((gsize) (end - pos) < range.length)
+			break;
+		range.data = pos;
+		pos += range.length;
+		g_array_append_val(*ranges, range);
+	}
+	if (pos != end)
+	{
+		g_array_free(*ranges, TRUE);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// Write ranges into file and set its length. Returns 0 or errno.
+//   File must still be old. When replaying, it may already have been
+//   (partly) patched: it must only be the same file, old or new length.
+static gint apply_ranges(const gchar *filename, const IoEngineRange *ranges,
+		guint n_ranges, const IoEngineFileId *old, gsize length, gboolean replaying)
+{
+	gint fd = g_open(filename, O_WRONLY, 0);
+	if (fd < 0)
+		return errno;
+
+	struct stat st;
+	IoEngineFileId id;
+	gint err_no = 0;
+	guint n;
+	if (fstat(fd, &st) != 0)
+		err_no = errno;
+	else
+	{
+		get_file_id(&st, &id);
+		if (!replaying && memcmp(&id, old, sizeof(IoEngineFileId)) != 0)
+			err_no = ESTALE;
+		else if (replaying && (id.device != old->device || id.inode != old->inode
+				|| (id.size != old->size && id.size != length)))
+			err_no = ESTALE;
+	}
+
+	for (n = 0; err_no == 0 && n < n_ranges; n++)
+		err_no = transfer_sync(fd, (gchar *) ranges[n].data, ranges[n].length,
+				ranges[n].offset, TRUE, NULL);
+	if (err_no == 0 && length != id.size && ftruncate(fd, length) != 0)
+		err_no = errno;
+	if (err_no == 0 && fsync(fd) != 0)
+		err_no = errno;
+	if (close(fd) != 0 && err_no == 0)
+		err_no = errno;
+	return err_no;
+}
+
+// Sync the directory of filename, so its creation or removal is on disk
+static void sync_dir(const gchar *filename)
+{
+	gchar *dirname = g_path_get_dirname(filename);
+	gint fd = g_open(dirname, O_RDONLY, 0);
+	if (fd >= 0)
+	{
+		fsync(fd);
+		close(fd);
+	}
+	g_free(dirname);
+}
+
+#endif // G_OS_UNIX
+
+
+///////////////////////////////////
+// Public functions
+///////////////////////////////////
+
+// Read a whole file, like g_file_get_contents()
+gboolean io_engine_read_file(const gchar *filename, gchar **contents,
+		gsize *length, IoEngineFileId *id, GError **error)
+{
+	g_return_val_if_fail(filename != NULL && contents != NULL, FALSE);
+
+#ifndef G_OS_UNIX
+	if (id != NULL && !io_engine_get_file_id(filename, id))
+		memset(id, 0, sizeof(IoEngineFileId));
+	return g_file_get_contents(filename, contents, length, error);
+#else
+	gint fd = g_open(filename, O_RDONLY, 0);
+	if (fd < 0)
+	{
+		set_errno_error(error, errno, _("Failed to open file \"%s\": %s"), filename);
+		return FALSE;
+	}
+
+	struct stat st;
+	if (id != NULL)
+		memset(id, 0, sizeof(IoEngineFileId));
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		// Not a regular file: size is unknown, let GLib handle it
+		close(fd);
+		return g_file_get_contents(filename, contents, length, error);
+	}
+
+	// What is read is the file as it was now; if written meanwhile, it won't
+	//   be the same anymore
+	if (id != NULL)
+		get_file_id(&st, id);
+
+	gsize size = st.st_size;
+	gchar *buf = g_try_malloc(size + 1);
+	if (buf == NULL)
+	{
+		close(fd);
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOMEM,
+				_("Could not allocate %lu bytes to read file \"%s\""),
+				(gulong) size + 1, filename);
+		return FALSE;
+	}
+
+	gint err_no = transfer(fd, buf, &size, FALSE);
+	close(fd);
+	if (err_no != 0)
+	{
+		g_free(buf);
+		set_errno_error(error, err_no, _("Failed to read from file \"%s\": %s"), filename);
+		return FALSE;
+	}
+
+	buf[size] = '\0';
+	*contents = buf;
+	if (length != NULL)
+		*length = size;
+	return TRUE;
+#endif
+}
+
+// Write a whole file, like g_file_set_contents()
+gboolean io_engine_write_file(const gchar *filename, const gchar *contents,
+		gsize length, GError **error)
+{
+	g_return_val_if_fail(filename != NULL && (contents != NULL || length == 0), FALSE);
+
+#ifndef G_OS_UNIX
+	return g_file_set_contents(filename, contents, length, error);
+#else
+	gchar *tmp_name = g_strdup_printf("%s.XXXXXX", filename);
+#if GLIB_CHECK_VERSION(2,22,0)
+	gint fd = g_mkstemp_full(tmp_name, O_RDWR | O_CREAT | O_EXCL, 0666);
+#else
+	gint fd = g_mkstemp(tmp_name);
+#endif
+	if (fd < 0)
+	{
+		set_errno_error(error, errno, _("Failed to create file \"%s\": %s"), tmp_name);
+		g_free(tmp_name);
+		return FALSE;
+	}
+
+	// Keep permissions of the file being replaced
+	struct stat st;
+	if (g_stat(filename, &st) == 0)
+		fchmod(fd, st.st_mode & 07777);
+
+	gsize size = length;
+	gint err_no = transfer(fd, (gchar *) contents, &size, TRUE);
+	if (close(fd) != 0 && err_no == 0)
+		err_no = errno;
+
+	if (err_no == 0 && g_rename(tmp_name, filename) != 0)
+		err_no = errno;
+
+	if (err_no != 0)
+	{
+		g_unlink(tmp_name);
+		set_errno_error(error, err_no, _("Failed to write file \"%s\": %s"), filename);
+		g_free(tmp_name);
+		return FALSE;
+	}
+
+	// A patch that failed before is superseded
+	gchar *logname = redo_log_name(filename);
+	g_unlink(logname);
+	g_free(logname);
+
+	g_free(tmp_name);
+	return TRUE;
+#endif
+}
+
+// Finish a patch interrupted by a crash, if any
+gboolean io_engine_recover_file(const gchar *filename, GError **error)
+{
+	g_return_val_if_fail(filename != NULL, FALSE);
+
+#ifndef G_OS_UNIX
+	// Files are never patched, so there is nothing to finish
+	return TRUE;
+#else
+	gchar *logname = redo_log_name(filename);
+	gchar *log;
+	gsize size;
+	gint err_no = 0;
+
+	if (g_file_get_contents(logname, &log, &size, NULL))
+	{
+		GArray *ranges;
+		IoEngineFileId old;
+		gsize length;
+
+		if (parse_redo_log(log, size, &ranges, &old, &length))
+		{
+			err_no = apply_ranges(filename, (IoEngineRange *) ranges->data, ranges->len,
+					&old, length, TRUE);
+			g_array_free(ranges, TRUE);
+			// Nor does it to a file removed since then
+			if (err_no == ENOENT)
+				err_no = ESTALE;
+		}
+		// An incomplete log was never applied, and one for a file replaced
+		//   since then doesn't apply anymore: just drop them
+		if (err_no == 0 || err_no == ESTALE)
+			g_unlink(logname);
+		g_free(log);
+	}
+
+	if (err_no == ESTALE)
+		set_errno_error(error, err_no, _("Dropped an interrupted patch of file \"%s\": %s"),
+				filename);
+	else if (err_no != 0)
+		set_errno_error(error, err_no, _("Failed to write file \"%s\": %s"), filename);
+	g_free(logname);
+	return err_no == 0;
+#endif
+}
+
+// What a file is on disk
+gboolean io_engine_get_file_id(const gchar *filename, IoEngineFileId *id)
+{
+	g_return_val_if_fail(filename != NULL && id != NULL, FALSE);
+
+	struct stat st;
+	if (g_stat(filename, &st) != 0 || !S_ISREG(st.st_mode))
+		return FALSE;
+
+	get_file_id(&st, id);
+	return TRUE;
+}
+
+// Write only some ranges of a file in place
+gboolean io_engine_patch_file(const gchar *filename, const IoEngineRange *ranges,
+		guint n_ranges, const IoEngineFileId *old, gsize length, GError **error)
+{
+	g_return_val_if_fail(filename != NULL && (ranges != NULL || n_ranges == 0), FALSE);
+	g_return_val_if_fail(old != NULL, FALSE);
+
+#ifndef G_OS_UNIX
+	g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOSYS,
+			_("Failed to patch file \"%s\": not supported"), filename);
+	return FALSE;
+#else
+	// A patch left from a crash is finished first, if it still applies; if
+	//   it was, file isn't old anymore
+	io_engine_recover_file(filename, NULL);
+
+	// Someone else changed the file since it was saved?
+	IoEngineFileId id;
+	if (!io_engine_get_file_id(filename, &id)
+			|| memcmp(&id, old, sizeof(IoEngineFileId)) != 0)
+	{
+		set_errno_error(error, ESTALE, _("Failed to patch file \"%s\": %s"), filename);
+		return FALSE;
+	}
+
+	// Ranges go to the log first, then into the file
+	gchar *logname = redo_log_name(filename);
+	GString *log = build_redo_log(ranges, n_ranges, old, length);
+	gint err_no = 0;
+	gint fd = g_open(logname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		err_no = errno;
+	else
+	{
+		err_no = transfer_sync(fd, log->str, log->len, 0, TRUE, NULL);
+		if (err_no == 0 && fsync(fd) != 0)
+			err_no = errno;
+		if (close(fd) != 0 && err_no == 0)
+			err_no = errno;
+	}
+	g_string_free(log, TRUE);
+
+	if (err_no != 0)
+	{
+		g_unlink(logname);
+		set_errno_error(error, err_no, _("Failed to write file \"%s\": %s"), logname);
+		g_free(logname);
+		return FALSE;
+	}
+	sync_dir(logname);
+
+	// If this fails, log stays: a full write will drop it, or it's replayed
+	err_no = apply_ranges(filename, ranges, n_ranges, old, length, FALSE);
+	if (err_no != 0)
+	{
+		set_errno_error(error, err_no, _("Failed to write file \"%s\": %s"), filename);
+		g_free(logname);
+		return FALSE;
+	}
+
+	g_unlink(logname);
+	g_free(logname);
+	return TRUE;
+#endif
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright © 2011 Rodolfo Ribeiro Gomes <rodolforg arr0ba gmail.com>
+ *
+ * A file handler for GTK+
+ *
+    This file is part of GtkFileHandler.
+
+    GtkFileHandler is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GtkFileHandler is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GtkFileHandler.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef R_IO_ENGINE_H_
+#define R_IO_ENGINE_H_
+
+#include <glib.h>
+
+// How big files are read and written
+//   Files are split in chunks transferred at once, to keep the disk queue
+//   full. With io_uring (if built with HAVE_LIBURING and supported by the
+//   kernel), chunks are submitted in batches from a single thread; otherwise
+//   a pool of threads does them in parallel. Small files are read or written
+//   in a single call.
+typedef enum {
+	IO_ENGINE_AUTO,
+	IO_ENGINE_URING,
+	IO_ENGINE_THREADS
+} IoEngineBackend;
+
+// Choose the backend. IO_ENGINE_AUTO (the default) uses io_uring when
+//   it's available. Asking for IO_ENGINE_URING where it isn't available
+//   falls back to threads.
+void io_engine_set_backend(IoEngineBackend backend);
+
+// The backend really used
+IoEngineBackend io_engine_get_backend(void);
+
+// What a file is on disk: if any of it changes, the file was replaced or
+//   written to, e.g. by another program.
+typedef struct {
+	guint64 device;
+	guint64 inode;
+	// Modification time, in nanoseconds
+	gint64 mtime;
+	guint64 size;
+} IoEngineFileId;
+
+// Read a whole file, like g_file_get_contents()
+//   It doesn't touch GTK+, so it can be called from any thread.
+//   If id isn't NULL, it's set to what the file read was (see
+//   io_engine_get_file_id()), or zeroed if it isn't a regular file.
+gboolean io_engine_read_file(const gchar *filename, gchar **contents,
+		gsize *length, IoEngineFileId *id, GError **error);
+
+// Write a whole file, like g_file_set_contents()
+//   Data goes to a temporary file which is synced to disk and then renamed
+//   over filename, so it's never left half-written. It keeps the
+//   permissions of the file it replaces.
+gboolean io_engine_write_file(const gchar *filename, const gchar *contents,
+		gsize length, GError **error);
+
+// A piece of a file: length bytes of data at offset
+typedef struct {
+	guint64 offset;
+	gsize length;
+	const gchar *data;
+} IoEngineRange;
+
+// Returns FALSE if filename isn't a regular file that can be stat'ed
+gboolean io_engine_get_file_id(const gchar *filename, IoEngineFileId *id);
+
+// Write only some ranges of a file in place, and make it length long,
+//   e.g. to save a few edited bytes of a huge file. The file must still be
+//   old (see io_engine_get_file_id()), otherwise nothing is done.
+//   Ranges are first written to a redo log next to the file and synced.
+//   If the program dies while patching the file, the log is replayed the
+//   next time the file is patched or recovered.
+// Returns FALSE if the file couldn't be patched: then write it whole.
+//   Off Unix, files are never patched.
+gboolean io_engine_patch_file(const gchar *filename, const IoEngineRange *ranges,
+		guint n_ranges, const IoEngineFileId *old, gsize length, GError **error);
+
+// Finish a patch of filename interrupted by a crash, if any, e.g. before
+//   opening it for editing. Reading a file never does it.
+//   The log is only replayed into the same file (device and inode) it was
+//   written for, at its old or new length. Otherwise the file was replaced
+//   or rewritten since then, and the log is dropped: FALSE is returned, with
+//   an ESTALE error. It's also FALSE if the file couldn't be written, but
+//   then the log is kept.
+gboolean io_engine_recover_file(const gchar *filename, GError **error);
+
+#endif // R_IO_ENGINE_H_
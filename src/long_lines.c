@@ -0,0 +1,137 @@
+/*
+ * Copyright © 2011 Rodolfo Ribeiro Gomes <rodolforg arr0ba gmail.com>
+ *
+ * A file handler for GTK+
+ *
+    This file is part of GtkFileHandler.
+
+    GtkFileHandler is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GtkFileHandler is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GtkFileHandler.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "long_lines.h"
+
+#include <string.h>
+#include <glib/gi18n.h>
+
+///////////////////////////////////
+// For internal use
+///////////////////////////////////
+
+// Segments may end a bit earlier, right after one of these
+#define BREAK_AFTER " ,;"
+#define BREAK_LOOKBACK 8
+
+// Next end of line, or end of text
+//   memchr() is vectorized by C libraries, so lines are found at memory speed.
+static const gchar *line_end(const gchar *line, const gchar *end)
+{
+	const gchar *eol = memchr(line, '\n', end - line);
+	return eol != NULL ? eol : end;
+}
+
+// Back to the start of the UTF-8 character at p
+static const gchar *char_start(const gchar *start, const gchar *p)
+{
+	while (p > start && (*p & 0xC0) == 0x80)
+		p--;
+	return p;
+}
+
+// Where a segment starting at seg should end
+static const gchar *segment_end(const gchar *seg, gsize segment)
+{
+	const gchar *cut = char_start(seg, seg + segment);
+	const gchar *p;
+	for (p = cut - 1; p > cut - segment / BREAK_LOOKBACK; p--)
+	{
+		if (*p != '\0' && strchr(BREAK_AFTER, *p) != NULL)
+			return p + 1;
+	}
+	return cut > seg ? cut : g_utf8_next_char(seg);
+}
+
+///////////////////////////////////
+// Long lines
+///////////////////////////////////
+
+GArray *long_lines_get_breaks(const gchar *text, gsize length, gsize limit, gsize segment)
+{
+	g_return_val_if_fail(text != NULL || length == 0, NULL);
+	g_return_val_if_fail(segment > 0 && segment <= limit, NULL);
+
+	if (length <= limit)
+		return NULL;
+
+	GArray *breaks = NULL;
+	const gchar *end = text + length;
+	// Characters are only counted up to long lines
+	const gchar *counted = text;
+	gsize chars = 0;
+
+	const gchar *line;
+	for (line = text; line < end; )
+	{
+		const gchar *eol = line_end(line, end);
+		if ((gsize) (eol - line) > limit)
+		{
+			if (breaks == NULL)
+				breaks = g_array_new(FALSE, FALSE, sizeof(gsize));
+
+			const gchar *seg = line;
+			while ((gsize) (eol - seg) > segment)
+			{
+				const gchar *cut = segment_end(seg, segment);
+				chars += g_utf8_strlen(counted, cut - counted);
+				counted = cut;
+				g_array_append_val(breaks, chars);
+				seg = cut;
+			}
+		}
+		line = eol + 1;
+	}
+	return breaks;
+}
+
+gchar *long_lines_truncate(const gchar *text, gsize length, gsize limit,
+		gsize *truncated_length)
+{
+	g_return_val_if_fail(text != NULL || length == 0, NULL);
+
+	GString *out = g_string_sized_new(MIN(length, 1024 * 1024) + 1);
+	const gchar *end = text + length;
+
+	const gchar *line;
+	for (line = text; line < end; )
+	{
+		const gchar *eol = line_end(line, end);
+		gsize bytes = eol - line;
+		if (bytes > limit)
+		{
+			const gchar *cut = char_start(line, line + limit);
+			g_string_append_len(out, line, cut - line);
+			g_string_append_printf(out, _(" [… %" G_GSIZE_FORMAT " bytes more]"),
+					(gsize) (eol - cut));
+		}
+		else
+			g_string_append_len(out, line, bytes);
+
+		if (eol < end)
+			g_string_append_c(out, '\n');
+		line = eol + 1;
+	}
+
+	if (truncated_length != NULL)
+		*truncated_length = out->len;
+	return g_string_free(out, FALSE);
+}
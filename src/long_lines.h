@@ -0,0 +1,49 @@
+/*
+ * Copyright © 2011 Rodolfo Ribeiro Gomes <rodolforg arr0ba gmail.com>
+ *
+ * A file handler for GTK+
+ *
+    This file is part of GtkFileHandler.
+
+    GtkFileHandler is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GtkFileHandler is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GtkFileHandler.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef R_LONG_LINES_H_
+#define R_LONG_LINES_H_
+
+#include <glib.h>
+
+// Lines too long to be laid out quickly
+//   GtkTextView lays out a whole line (paragraph) at once, so a line of some
+//   megabytes, e.g. minified JSON or a log, takes seconds. Such a line can be
+//   shown split in segments by soft breaks (see text_mirror_set_text()),
+//   or cut short in a read-only preview.
+
+// Lines longer than this, in bytes, are split in segments
+#define LONG_LINES_LIMIT (16 * 1024)
+// Segment size, in bytes. Preview cuts long lines at this size too.
+#define LONG_LINES_SEGMENT (4 * 1024)
+
+// Where soft breaks should go so no line of text is longer than limit bytes:
+//   each long line is cut in segments of about segment bytes, preferably
+//   after a space or comma. Returns an array of character offsets in text
+//   (gsize), ascending, or NULL if no line is too long.
+GArray *long_lines_get_breaks(const gchar *text, gsize length, gsize limit, gsize segment);
+
+// Copy of text with each line longer than limit bytes cut to it, followed by
+//   a note of how much was left out. Free it with g_free().
+gchar *long_lines_truncate(const gchar *text, gsize length, gsize limit,
+		gsize *truncated_length);
+
+#endif // R_LONG_LINES_H_
@@ -23,17 +23,213 @@
 
 #include <glib/gi18n.h>
 
-void showErrorMessage (GtkWindow *parent, const gchar *msg)
+///////////////////////////////////
+// For internal use
+///////////////////////////////////
+
+// A dismissed message is dropped if it comes back within this time
+#define NOTIFICATION_RATE_LIMIT 2.0
+// Messages waiting beyond this are dropped
+#define NOTIFICATION_MAX_PENDING 16
+// Info messages hide by themselves after this, in seconds
+#define NOTIFICATION_INFO_TIMEOUT 5
+
+typedef struct {
+	GtkMessageType type;
+	gchar *msg;
+	guint count;
+} Notification;
+
+// Notifications of a window
+typedef struct {
+	GtkWindow *parent;
+	GtkWidget *area;
+	gint position;
+
+	GQueue pending;
+	Notification *shown;
+	GtkWidget *widget;
+	GtkWidget *label;
+	guint timeout_id;
+
+	// Last time each message was dismissed
+	GTimer *timer;
+	GHashTable *dismissed;
+} NotificationQueue;
+
+static const gchar * const QUEUE_KEY = "message-dialogs-queue";
+
+static void show_next_notification(NotificationQueue *queue);
+
+static gchar *get_title(GtkMessageType type)
+{
+	const gchar *appname = g_get_application_name();
+	if (type == GTK_MESSAGE_ERROR)
+		return g_strdup_printf(_("%s - Error!"), appname);
+	if (type == GTK_MESSAGE_WARNING)
+		return g_strdup_printf(_("%s - Warning!"), appname);
+	return g_strdup(appname);
+}
+
+// Key to identify equal messages
+static gchar *get_key(GtkMessageType type, const gchar *msg)
+{
+	return g_strdup_printf("%d:%s", type, msg);
+}
+
+static void free_notification(Notification *notification)
+{
+	if (notification == NULL)
+		return;
+	g_free(notification->msg);
+	g_free(notification);
+}
+
+static void free_queue(gpointer data)
+{
+	NotificationQueue *queue = data;
+	Notification *notification;
+
+	if (queue->timeout_id != 0)
+		g_source_remove(queue->timeout_id);
+	while ((notification = g_queue_pop_head(&queue->pending)) != NULL)
+		free_notification(notification);
+	free_notification(queue->shown);
+	g_timer_destroy(queue->timer);
+	g_hash_table_destroy(queue->dismissed);
+	g_free(queue);
+}
+
+static NotificationQueue *get_queue(GtkWindow *parent)
+{
+	NotificationQueue *queue = g_object_get_data(G_OBJECT(parent), QUEUE_KEY);
+	if (queue != NULL)
+		return queue;
+
+	queue = g_new0(NotificationQueue, 1);
+	queue->parent = parent;
+	g_queue_init(&queue->pending);
+	queue->timer = g_timer_new();
+	queue->dismissed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	g_object_set_data_full(G_OBJECT(parent), QUEUE_KEY, queue, free_queue);
+	return queue;
+}
+
+static gchar *get_text(const Notification *notification)
+{
+	if (notification->count > 1)
+		return g_strdup_printf(_("%s (%u times)"), notification->msg, notification->count);
+	return g_strdup(notification->msg);
+}
+
+static void update_text(NotificationQueue *queue)
+{
+	gchar *text = get_text(queue->shown);
+	if (queue->label != NULL)
+		gtk_label_set_text(GTK_LABEL(queue->label), text);
+	else
+		gtk_message_dialog_format_secondary_text(GTK_MESSAGE_DIALOG(queue->widget), "%s", text);
+	g_free(text);
+}
+
+static void dismiss_notification(NotificationQueue *queue)
+{
+	if (queue->timeout_id != 0)
+	{
+		g_source_remove(queue->timeout_id);
+		queue->timeout_id = 0;
+	}
+
+	if (queue->shown != NULL)
+	{
+		gdouble *when = g_new(gdouble, 1);
+		*when = g_timer_elapsed(queue->timer, NULL);
+		g_hash_table_replace(queue->dismissed,
+				get_key(queue->shown->type, queue->shown->msg), when);
+		free_notification(queue->shown);
+		queue->shown = NULL;
+	}
+
+	if (queue->widget != NULL)
+	{
+		GtkWidget *widget = queue->widget;
+		queue->widget = NULL;
+		queue->label = NULL;
+		gtk_widget_destroy(widget);
+	}
+
+	show_next_notification(queue);
+}
+
+static void on_notification_response(GtkWidget *widget, gint response, gpointer data)
+{
+	dismiss_notification(data);
+}
+
+static gboolean on_notification_timeout(gpointer data)
+{
+	NotificationQueue *queue = data;
+	queue->timeout_id = 0;
+	dismiss_notification(queue);
+	return FALSE;
+}
+
+static void show_next_notification(NotificationQueue *queue)
+{
+	if (queue->shown != NULL)
+		return;
+	queue->shown = g_queue_pop_head(&queue->pending);
+	if (queue->shown == NULL)
+		return;
+
+	GtkMessageType type = queue->shown->type;
+	gchar *text = get_text(queue->shown);
+
+#if GTK_CHECK_VERSION(2,18,0)
+	if (queue->area != NULL)
+	{
+		queue->widget = gtk_info_bar_new_with_buttons(GTK_STOCK_CLOSE, GTK_RESPONSE_CLOSE, NULL);
+		gtk_info_bar_set_message_type(GTK_INFO_BAR(queue->widget), type);
+		queue->label = gtk_label_new(text);
+		gtk_label_set_line_wrap(GTK_LABEL(queue->label), TRUE);
+		gtk_container_add(GTK_CONTAINER(gtk_info_bar_get_content_area(GTK_INFO_BAR(queue->widget))),
+				queue->label);
+		gtk_box_pack_start(GTK_BOX(queue->area), queue->widget, FALSE, FALSE, 0);
+		gtk_box_reorder_child(GTK_BOX(queue->area), queue->widget, queue->position);
+	}
+	else
+#endif
+	{
+		gchar *title = get_title(type);
+		queue->widget = gtk_message_dialog_new(queue->parent,
+				GTK_DIALOG_DESTROY_WITH_PARENT, type, GTK_BUTTONS_CLOSE, "%s", title);
+		g_free(title);
+		gtk_message_dialog_format_secondary_text(GTK_MESSAGE_DIALOG(queue->widget), "%s", text);
+		gtk_window_set_title(GTK_WINDOW(queue->widget), g_get_application_name());
+		gtk_window_set_icon(GTK_WINDOW(queue->widget), gtk_window_get_icon(queue->parent));
+	}
+	g_free(text);
+
+	g_signal_connect(queue->widget, "response", G_CALLBACK(on_notification_response), queue);
+	gtk_widget_show_all(queue->widget);
+
+	if (type == GTK_MESSAGE_INFO)
+		queue->timeout_id = g_timeout_add(NOTIFICATION_INFO_TIMEOUT * 1000,
+				on_notification_timeout, queue);
+}
+
+// The old blocking way, for when there is no window
+static void runMessageDialog (GtkWindow *parent, GtkMessageType type, const gchar *msg)
 {
 	const gchar *appname = g_get_application_name();
 	
-	gchar *msg1 = g_strdup_printf(_("%s - Error!"), appname);
+	gchar *msg1 = get_title(type);
 	GtkWidget *dialog = gtk_message_dialog_new(parent,
-			GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_ERROR,
-			GTK_BUTTONS_CLOSE, msg1);
+			GTK_DIALOG_DESTROY_WITH_PARENT, type,
+			GTK_BUTTONS_CLOSE, "%s", msg1);
 	g_free(msg1);
 	
-	gtk_message_dialog_format_secondary_text(GTK_MESSAGE_DIALOG(dialog), msg);
+	gtk_message_dialog_format_secondary_text(GTK_MESSAGE_DIALOG(dialog), "%s", msg);
 	
 	gtk_window_set_title(GTK_WINDOW(dialog), appname);
 	if (parent)
@@ -45,23 +241,77 @@ void showErrorMessage (GtkWindow *parent, const gchar *msg)
 	gtk_widget_destroy(dialog);
 }
 
-void showWarningMessage (GtkWindow *parent, const gchar *msg)
+///////////////////////////////////
+// Notifications
+///////////////////////////////////
+
+void showNotification (GtkWindow *parent, GtkMessageType type, const gchar *msg)
 {
-	const gchar *appname = g_get_application_name();
-	gchar *msg1 = g_strdup_printf(_("%s - Warning!"), appname);
-	GtkWidget *dialog = gtk_message_dialog_new(parent,
-			GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_WARNING,
-			GTK_BUTTONS_CLOSE, msg1);
-	g_free(msg1);
-	gtk_message_dialog_format_secondary_text(GTK_MESSAGE_DIALOG(dialog), msg);
-	gtk_window_set_title(GTK_WINDOW(dialog), appname);
-	if (parent)
+	if (msg == NULL)
+		return;
+
+	if (parent == NULL)
 	{
-		GdkPixbuf *icon = gtk_window_get_icon(parent);
-		gtk_window_set_icon(GTK_WINDOW(dialog), icon);
+		runMessageDialog(parent, type, msg);
+		return;
 	}
-	gtk_dialog_run(GTK_DIALOG(dialog));
-	gtk_widget_destroy(dialog);
+
+	NotificationQueue *queue = get_queue(parent);
+
+	// Same as shown or waiting one?
+	if (queue->shown != NULL && queue->shown->type == type
+			&& g_strcmp0(queue->shown->msg, msg) == 0)
+	{
+		queue->shown->count++;
+		update_text(queue);
+		return;
+	}
+	GList *it;
+	for (it = queue->pending.head; it != NULL; it = it->next)
+	{
+		Notification *notification = it->data;
+		if (notification->type == type && g_strcmp0(notification->msg, msg) == 0)
+		{
+			notification->count++;
+			return;
+		}
+	}
+
+	// Just dismissed?
+	gchar *key = get_key(type, msg);
+	gdouble *when = g_hash_table_lookup(queue->dismissed, key);
+	gboolean too_soon = when != NULL
+			&& g_timer_elapsed(queue->timer, NULL) - *when < NOTIFICATION_RATE_LIMIT;
+	g_free(key);
+	if (too_soon || queue->pending.length >= NOTIFICATION_MAX_PENDING)
+		return;
+
+	Notification *notification = g_new0(Notification, 1);
+	notification->type = type;
+	notification->msg = g_strdup(msg);
+	notification->count = 1;
+	g_queue_push_tail(&queue->pending, notification);
+
+	show_next_notification(queue);
+}
+
+void setNotificationArea (GtkWindow *parent, GtkWidget *box, gint position)
+{
+	g_return_if_fail(parent != NULL);
+
+	NotificationQueue *queue = get_queue(parent);
+	queue->area = box;
+	queue->position = position;
+}
+
+void showErrorMessage (GtkWindow *parent, const gchar *msg)
+{
+	showNotification(parent, GTK_MESSAGE_ERROR, msg);
+}
+
+void showWarningMessage (GtkWindow *parent, const gchar *msg)
+{
+	showNotification(parent, GTK_MESSAGE_WARNING, msg);
 }
 
 gint showYesNoDialog (GtkWindow *parent, const gchar *msg)
@@ -81,15 +331,35 @@ gint showYesNoDialog (GtkWindow *parent, const gchar *msg)
 }
 
 gint showYesNoCancelDialog (GtkWindow *parent, const gchar *msg)
+{
+	return showYesNoCancelDialogWithDetails(parent, msg, NULL, NULL);
+}
+
+gint showYesNoCancelDialogWithDetails (GtkWindow *parent, const gchar *msg,
+		const gchar *details_label, GtkWidget *details)
 {
 	GtkWidget *dialog = gtk_message_dialog_new(parent,
 			GTK_DIALOG_MODAL, GTK_MESSAGE_QUESTION, GTK_BUTTONS_NONE,
-			msg);
+			"%s", msg);
 	gtk_dialog_add_buttons(GTK_DIALOG(dialog), GTK_STOCK_YES, GTK_RESPONSE_YES,
 			GTK_STOCK_NO, GTK_RESPONSE_NO,
 			GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
 			NULL);
 
+	if (details != NULL)
+	{
+#if GTK_CHECK_VERSION(2,14,0)
+		GtkWidget *area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
+#else
+		GtkWidget *area = GTK_DIALOG(dialog)->vbox;
+#endif
+		GtkWidget *expander = gtk_expander_new_with_mnemonic(details_label);
+		gtk_container_add(GTK_CONTAINER(expander), details);
+		gtk_box_pack_end(GTK_BOX(area), expander, TRUE, TRUE, 0);
+		gtk_window_set_resizable(GTK_WINDOW(dialog), TRUE);
+		gtk_widget_show_all(expander);
+	}
+
 	gtk_window_set_title(GTK_WINDOW(dialog), g_get_application_name());
 	if (parent)
 	{
@@ -24,10 +24,28 @@
 
 #include <gtk/gtk.h>
 
+// Show a message without blocking: it's queued and shown when the previous
+//   ones are dismissed, as an info bar inside parent (see setNotificationArea)
+//   or as a non-modal dialog. A message equal to a queued one isn't shown
+//   twice, but counted; and one just dismissed isn't shown again so soon.
+//   If parent is NULL, there is no window to queue it in, so a modal dialog
+//   is shown instead.
+void showNotification (GtkWindow *parent, GtkMessageType type, const gchar *msg);
+
+// Show notifications of parent as info bars packed in box at position
+//   instead of as dialogs. box must be inside parent.
+void setNotificationArea (GtkWindow *parent, GtkWidget *box, gint position);
+
+// Same as showNotification() with an error or warning type
 void showErrorMessage (GtkWindow *parent, const gchar *msg);
 void showWarningMessage (GtkWindow *parent, const gchar *msg);
 gint showYesNoDialog (GtkWindow *parent, const gchar *msg);
 gint showYesNoCancelDialog (GtkWindow *parent, const gchar *msg);
 
+// Same as showYesNoCancelDialog(), with details widget hidden in an expander
+//   labeled details_label. details is only mapped when the user expands it.
+gint showYesNoCancelDialogWithDetails (GtkWindow *parent, const gchar *msg,
+		const gchar *details_label, GtkWidget *details);
+
 #endif // R_GTKMESSAGEDIALOGS
 
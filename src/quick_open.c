@@ -0,0 +1,744 @@
+/*
+ * Copyright © 2011 Rodolfo Ribeiro Gomes <rodolforg arr0ba gmail.com>
+ *
+ * A file handler for GTK+
+ *
+    This file is part of GtkFileHandler.
+
+    GtkFileHandler is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GtkFileHandler is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GtkFileHandler.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "quick_open.h"
+#include "file_loader.h"
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include <glib/gi18n.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#ifndef GDK_KEY_Escape
+#define GDK_KEY_Escape GDK_Escape
+#define GDK_KEY_Up GDK_Up
+#define GDK_KEY_Down GDK_Down
+#endif
+
+///////////////////////////////////
+// For internal use
+///////////////////////////////////
+
+// Directories watched for changes, all roots together, at most
+//   Each one takes an inotify watch on Linux, and a user has only a few
+//   thousand of them (fs.inotify.max_user_watches) shared by every program.
+#define MAX_WATCHED_DIRS 2048
+// Seconds to wait after a change before indexing again
+#define REINDEX_DELAY 2
+// Rows shown by the palette
+#define MAX_RESULTS 50
+
+// Names of indexed files, relative to their root, packed one after the
+//   other so a query just runs through memory. masks tells which
+//   characters each name has, to skip most names without looking at them.
+typedef struct {
+	GString *names;
+	GString *lower;
+	GArray *offsets;
+	GArray *masks;
+} NameTable;
+
+// A directory tree being indexed
+typedef struct {
+	gchar *path;
+	NameTable *table;
+	GPtrArray *monitors;
+	guint reindex_id;
+	gboolean building;
+	gboolean dirty;
+	// Every directory is watched, so table is kept current without indexing again
+	gboolean watched;
+} IndexRoot;
+
+// A walk over a root, done by worker threads
+typedef struct {
+	gchar *root_path;
+	GThreadPool *pool;
+	volatile gint pending;
+	// Files and directories found so far: walk stops at QUICK_OPEN_MAX_FILES
+	volatile gint found;
+	NameTable *table;
+	// WalkTask of every directory read
+	GPtrArray *dirs;
+} IndexBuild;
+
+// A directory to be read by a worker
+typedef struct {
+	gchar *path;
+	gchar *rel;
+	// Levels below root
+	guint depth;
+} WalkTask;
+
+// Palette window, if shown
+typedef struct {
+	Filehandler *fh;
+	GtkWidget *window;
+	GtkWidget *entry;
+	GtkWidget *view;
+	GtkWidget *status;
+	GtkListStore *store;
+} Palette;
+
+// IndexRoot, most recent first
+static GList *roots = NULL;
+static Palette *palette = NULL;
+
+G_LOCK_DEFINE_STATIC(build);
+
+static void start_build(IndexRoot *root);
+static void refresh_palette(void);
+
+static guint64 char_mask(guchar c)
+{
+	c = g_ascii_tolower(c);
+	if (c >= 'a' && c <= 'z')
+		return G_GUINT64_CONSTANT(1) << (c - 'a');
+	if (c >= '0' && c <= '9')
+		return G_GUINT64_CONSTANT(1) << (26 + c - '0');
+	return G_GUINT64_CONSTANT(1) << (36 + c % 28);
+}
+
+static NameTable *name_table_new(void)
+{
+	NameTable *table = g_new0(NameTable, 1);
+	table->names = g_string_new(NULL);
+	table->lower = g_string_new(NULL);
+	table->offsets = g_array_new(FALSE, FALSE, sizeof(guint32));
+	table->masks = g_array_new(FALSE, FALSE, sizeof(guint64));
+	return table;
+}
+
+static void name_table_free(NameTable *table)
+{
+	if (table == NULL)
+		return;
+	g_string_free(table->names, TRUE);
+	g_string_free(table->lower, TRUE);
+	g_array_free(table->offsets, TRUE);
+	g_array_free(table->masks, TRUE);
+	g_free(table);
+}
+
+static void name_table_add(NameTable *table, const gchar *name)
+{
+	guint32 offset = table->names->len;
+	guint64 mask = 0;
+	const gchar *c;
+
+	for (c = name; *c != '\0'; c++)
+		mask |= char_mask(*c);
+
+	g_string_append_len(table->names, name, strlen(name) + 1);
+	gchar *lower = g_ascii_strdown(name, -1);
+	g_string_append_len(table->lower, lower, strlen(lower) + 1);
+	g_free(lower);
+
+	g_array_append_val(table->offsets, offset);
+	g_array_append_val(table->masks, mask);
+}
+
+// How well name matches query (both lowercase), or -1 if it doesn't
+//   Letters right after a separator, in the base name or following the
+//   previous one count more; long paths count less.
+static gint fuzzy_score(const gchar *name, const gchar *query)
+{
+	const gchar *basename = strrchr(name, G_DIR_SEPARATOR);
+	const gchar *p = name, *prev = NULL;
+	gint score = 0, run = 0;
+
+	basename = basename != NULL ? basename + 1 : name;
+
+	for (; *query != '\0'; query++)
+	{
+		while (*p != '\0' && *p != *query)
+			p++;
+		if (*p == '\0')
+			return -1;
+
+		gint bonus = 1;
+		if (p == name || strchr("/_-. ", p[-1]) != NULL)
+			bonus += 8;
+		if (p >= basename)
+			bonus += 2;
+		if (prev != NULL && p == prev + 1)
+			bonus += 4 * ++run;
+		else
+			run = 0;
+
+		score += bonus;
+		prev = p++;
+	}
+	return score - (gint) (strlen(name) / 8);
+}
+
+static IndexRoot *find_root(const gchar *path)
+{
+	GList *it;
+	for (it = roots; it != NULL; it = it->next)
+	{
+		IndexRoot *root = it->data;
+		if (g_strcmp0(root->path, path) == 0)
+			return root;
+	}
+	return NULL;
+}
+
+///////////////////////////////////
+// Indexing
+///////////////////////////////////
+
+static gboolean build_finished(gpointer data);
+
+static void free_task(WalkTask *task)
+{
+	g_free(task->path);
+	g_free(task->rel);
+	g_free(task);
+}
+
+// Count one more entry found, returning how many were found before it
+static gint count_found(IndexBuild *build)
+{
+#if GLIB_CHECK_VERSION(2,30,0)
+	return g_atomic_int_add(&build->found, 1);
+#else
+	return g_atomic_int_exchange_and_add(&build->found, 1);
+#endif
+}
+
+// Runs on a worker thread
+
+static void walk_dir(gpointer data, gpointer pool_data)
+{
+	WalkTask *task = data;
+	IndexBuild *build = pool_data;
+	GDir *dir = g_dir_open(task->path, 0, NULL);
+
+	if (dir != NULL)
+	{
+		GPtrArray *files = g_ptr_array_new();
+		const gchar *name;
+		guint n;
+
+		while ((name = g_dir_read_name(dir)) != NULL)
+		{
+			// Skip hidden entries, e.g., .git
+			if (name[0] == '.')
+				continue;
+
+			// Big enough: the rest of the tree isn't walked
+			if (count_found(build) >= QUICK_OPEN_MAX_FILES)
+				break;
+
+			gchar *full = g_build_filename(task->path, name, NULL);
+			gchar *rel = task->rel[0] != '\0' ? g_build_filename(task->rel, name, NULL)
+					: g_strdup(name);
+			struct stat st;
+
+			if (g_lstat(full, &st) == 0 && S_ISDIR(st.st_mode))
+			{
+				WalkTask *sub = g_new(WalkTask, 1);
+				sub->path = full;
+				sub->rel = rel;
+				sub->depth = task->depth + 1;
+				g_atomic_int_inc(&build->pending);
+				g_thread_pool_push(build->pool, sub, NULL);
+				continue;
+			}
+
+			g_free(full);
+			g_ptr_array_add(files, rel);
+		}
+		g_dir_close(dir);
+
+		G_LOCK(build);
+		for (n = 0; n < files->len; n++)
+		{
+			if (build->table->offsets->len < QUICK_OPEN_MAX_FILES)
+				name_table_add(build->table, g_ptr_array_index(files, n));
+			g_free(g_ptr_array_index(files, n));
+		}
+		g_ptr_array_add(build->dirs, task);
+		G_UNLOCK(build);
+
+		g_ptr_array_free(files, TRUE);
+	}
+	else
+		free_task(task);
+
+	if (g_atomic_int_dec_and_test(&build->pending))
+		g_idle_add(build_finished, build);
+}
+
+static void on_dir_changed(GFileMonitor *monitor, GFile *file, GFile *other_file,
+		GFileMonitorEvent event_type, gpointer data);
+
+static void unwatch_root(IndexRoot *root)
+{
+	guint n;
+	for (n = 0; n < root->monitors->len; n++)
+	{
+		GFileMonitor *monitor = g_ptr_array_index(root->monitors, n);
+		g_signal_handlers_disconnect_by_func(monitor, on_dir_changed, root);
+		g_file_monitor_cancel(monitor);
+		g_object_unref(monitor);
+	}
+	g_ptr_array_set_size(root->monitors, 0);
+}
+
+static gint compare_depth(gconstpointer a, gconstpointer b)
+{
+	const WalkTask *task_a = *(WalkTask * const *) a;
+	const WalkTask *task_b = *(WalkTask * const *) b;
+	return task_a->depth < task_b->depth ? -1 : task_a->depth > task_b->depth;
+}
+
+// Watch dirs of root, upper levels first, with what is left of MAX_WATCHED_DIRS
+//   Sorts dirs. If some can't be watched, root is marked as not watched.
+static void watch_dirs(IndexRoot *root, GPtrArray *dirs)
+{
+	guint budget = MAX_WATCHED_DIRS;
+	guint n;
+	GList *it;
+
+	unwatch_root(root);
+	for (it = roots; it != NULL; it = it->next)
+	{
+		IndexRoot *other = it->data;
+		budget -= MIN(budget, other->monitors->len);
+	}
+
+	g_ptr_array_sort(dirs, compare_depth);
+	root->watched = dirs->len <= budget;
+	for (n = 0; n < dirs->len && n < budget; n++)
+	{
+		WalkTask *task = g_ptr_array_index(dirs, n);
+		GFile *file = g_file_new_for_path(task->path);
+		GFileMonitor *monitor = g_file_monitor_directory(file, G_FILE_MONITOR_NONE, NULL, NULL);
+		g_object_unref(file);
+		if (monitor == NULL)
+		{
+			root->watched = FALSE;
+			continue;
+		}
+		g_signal_connect(monitor, "changed", G_CALLBACK(on_dir_changed), root);
+		g_ptr_array_add(root->monitors, monitor);
+	}
+}
+
+// Runs on main loop, once every directory was read
+static gboolean build_finished(gpointer data)
+{
+	IndexBuild *build = data;
+	IndexRoot *root = find_root(build->root_path);
+
+	g_thread_pool_free(build->pool, FALSE, TRUE);
+
+	if (root != NULL)
+	{
+		name_table_free(root->table);
+		root->table = build->table;
+		build->table = NULL;
+		root->building = FALSE;
+		watch_dirs(root, build->dirs);
+
+		if (root->dirty)
+			start_build(root);
+	}
+
+	name_table_free(build->table);
+	g_ptr_array_foreach(build->dirs, (GFunc) free_task, NULL);
+	g_ptr_array_free(build->dirs, TRUE);
+	g_free(build->root_path);
+	g_free(build);
+
+	refresh_palette();
+	return FALSE;
+}
+
+static void start_build(IndexRoot *root)
+{
+	IndexBuild *build = g_new0(IndexBuild, 1);
+	build->root_path = g_strdup(root->path);
+	build->table = name_table_new();
+	build->dirs = g_ptr_array_new();
+	build->pending = 1;
+	build->pool = g_thread_pool_new(walk_dir, build, file_loader_default_threads(),
+			FALSE, NULL);
+
+	root->building = TRUE;
+	root->dirty = FALSE;
+
+	WalkTask *task = g_new(WalkTask, 1);
+	task->path = g_strdup(root->path);
+	task->rel = g_strdup("");
+	task->depth = 0;
+	g_thread_pool_push(build->pool, task, NULL);
+}
+
+static gboolean on_reindex_timeout(gpointer data)
+{
+	IndexRoot *root = data;
+	root->reindex_id = 0;
+	if (root->building)
+		root->dirty = TRUE;
+	else
+		start_build(root);
+	return FALSE;
+}
+
+// Something changed in a directory: index again, once things calm down
+static void on_dir_changed(GFileMonitor *monitor, GFile *file, GFile *other_file,
+		GFileMonitorEvent event_type, gpointer data)
+{
+	IndexRoot *root = data;
+
+	if (event_type != G_FILE_MONITOR_EVENT_CREATED
+			&& event_type != G_FILE_MONITOR_EVENT_DELETED
+			&& event_type != G_FILE_MONITOR_EVENT_MOVED)
+		return;
+
+	if (root->reindex_id != 0)
+		g_source_remove(root->reindex_id);
+	root->reindex_id = g_timeout_add_seconds(REINDEX_DELAY, on_reindex_timeout, root);
+}
+
+static void free_root(IndexRoot *root)
+{
+	unwatch_root(root);
+	g_ptr_array_free(root->monitors, TRUE);
+	if (root->reindex_id != 0)
+		g_source_remove(root->reindex_id);
+	name_table_free(root->table);
+	g_free(root->path);
+	g_free(root);
+}
+
+///////////////////////////////////
+// Index
+///////////////////////////////////
+
+// Start indexing dirname in background, if it isn't yet
+void quick_open_add_root(const gchar *dirname)
+{
+	g_return_if_fail(dirname != NULL);
+
+	IndexRoot *root = find_root(dirname);
+	if (root != NULL)
+	{
+		roots = g_list_remove(roots, root);
+		roots = g_list_prepend(roots, root);
+		return;
+	}
+
+	root = g_new0(IndexRoot, 1);
+	root->path = g_strdup(dirname);
+	root->monitors = g_ptr_array_new();
+	roots = g_list_prepend(roots, root);
+	start_build(root);
+
+	// A build of a forgotten root is dropped when it finishes
+	if (g_list_length(roots) > QUICK_OPEN_MAX_ROOTS)
+	{
+		GList *oldest = g_list_last(roots);
+		free_root(oldest->data);
+		roots = g_list_delete_link(roots, oldest);
+	}
+}
+
+typedef struct {
+	gint score;
+	const IndexRoot *root;
+	guint32 offset;
+} Match;
+
+// Find files whose path matches query, best ones first
+guint quick_open_query(const gchar *query, gchar **results, guint max_results)
+{
+	g_return_val_if_fail(query != NULL && results != NULL, 0);
+
+	if (max_results == 0)
+		return 0;
+
+	// Spaces in query are just for readability
+	gchar **words = g_strsplit(query, " ", -1);
+	gchar *joined = g_strjoinv("", words);
+	gchar *lower = g_ascii_strdown(joined, -1);
+	g_free(joined);
+	g_strfreev(words);
+
+	guint64 query_mask = 0;
+	const gchar *c;
+	for (c = lower; *c != '\0'; c++)
+		query_mask |= char_mask(*c);
+
+	Match *best = g_new(Match, max_results);
+	guint found = 0;
+	GList *it;
+
+	for (it = roots; it != NULL; it = it->next)
+	{
+		const IndexRoot *root = it->data;
+		if (root->table == NULL)
+			continue;
+
+		const guint64 *masks = (const guint64 *) root->table->masks->data;
+		const guint32 *offsets = (const guint32 *) root->table->offsets->data;
+		const gchar *names = root->table->lower->str;
+		guint count = root->table->offsets->len;
+		guint n;
+
+		for (n = 0; n < count; n++)
+		{
+			if ((masks[n] & query_mask) != query_mask)
+				continue;
+
+			gint score = fuzzy_score(names + offsets[n], lower);
+			if (score < 0 || (found == max_results && score <= best[found - 1].score))
+				continue;
+
+			// Insert sorted
+			guint pos = found < max_results ? found++ : found - 1;
+			while (pos > 0 && best[pos - 1].score < score)
+			{
+				best[pos] = best[pos - 1];
+				pos--;
+			}
+			best[pos].score = score;
+			best[pos].root = root;
+			best[pos].offset = offsets[n];
+		}
+	}
+
+	guint n;
+	for (n = 0; n < found; n++)
+		results[n] = g_build_filename(best[n].root->path,
+				best[n].root->table->names->str + best[n].offset, NULL);
+
+	g_free(best);
+	g_free(lower);
+	return found;
+}
+
+///////////////////////////////////
+// Palette
+///////////////////////////////////
+
+static gboolean is_indexing(void)
+{
+	GList *it;
+	for (it = roots; it != NULL; it = it->next)
+		if (((IndexRoot *) it->data)->building)
+			return TRUE;
+	return FALSE;
+}
+
+static void refresh_palette(void)
+{
+	if (palette == NULL)
+		return;
+
+	gchar *results[MAX_RESULTS];
+	guint found = quick_open_query(gtk_entry_get_text(GTK_ENTRY(palette->entry)),
+			results, MAX_RESULTS);
+	guint n;
+
+	gtk_list_store_clear(palette->store);
+	for (n = 0; n < found; n++)
+	{
+		GtkTreeIter iter;
+		gtk_list_store_append(palette->store, &iter);
+		gtk_list_store_set(palette->store, &iter, 0, results[n], -1);
+		g_free(results[n]);
+	}
+
+	if (found > 0)
+	{
+		GtkTreePath *path = gtk_tree_path_new_first();
+		gtk_tree_view_set_cursor(GTK_TREE_VIEW(palette->view), path, NULL, FALSE);
+		gtk_tree_path_free(path);
+	}
+
+	gtk_label_set_text(GTK_LABEL(palette->status), is_indexing() ? _("Indexing...") : "");
+}
+
+// Open the selected file
+static void palette_open_selected(void)
+{
+	GtkTreeSelection *selection = gtk_tree_view_get_selection(GTK_TREE_VIEW(palette->view));
+	GtkTreeModel *model;
+	GtkTreeIter iter;
+	gchar *filename = NULL;
+
+	if (gtk_tree_selection_get_selected(selection, &model, &iter))
+		gtk_tree_model_get(model, &iter, 0, &filename, -1);
+	if (filename == NULL)
+		return;
+
+	// Palette goes away before the user may be asked about current file
+	Filehandler *fh = palette->fh;
+	gtk_widget_destroy(palette->window);
+
+	filehandler_open_file(fh, filename);
+	g_free(filename);
+}
+
+static void on_palette_entry_changed(GtkEditable *editable, gpointer data)
+{
+	refresh_palette();
+}
+
+static void on_palette_entry_activate(GtkEntry *entry, gpointer data)
+{
+	palette_open_selected();
+}
+
+static void on_palette_row_activated(GtkTreeView *view, GtkTreePath *path,
+		GtkTreeViewColumn *column, gpointer data)
+{
+	palette_open_selected();
+}
+
+// Keys on the entry: Escape closes; Up/Down move through results
+static gboolean on_palette_key_press_event(GtkWidget *widget, GdkEventKey *event,
+		gpointer data)
+{
+	if (event->keyval == GDK_KEY_Escape)
+	{
+		gtk_widget_destroy(palette->window);
+		return TRUE;
+	}
+
+	if (event->keyval != GDK_KEY_Up && event->keyval != GDK_KEY_Down)
+		return FALSE;
+
+	GtkTreePath *path = NULL;
+	gtk_tree_view_get_cursor(GTK_TREE_VIEW(palette->view), &path, NULL);
+	if (path == NULL)
+		return TRUE;
+
+	if (event->keyval == GDK_KEY_Up)
+		gtk_tree_path_prev(path);
+	else
+		gtk_tree_path_next(path);
+
+	GtkTreeIter iter;
+	if (gtk_tree_model_get_iter(GTK_TREE_MODEL(palette->store), &iter, path))
+		gtk_tree_view_set_cursor(GTK_TREE_VIEW(palette->view), path, NULL, FALSE);
+	gtk_tree_path_free(path);
+	return TRUE;
+}
+
+static void on_palette_destroy(GtkWidget *widget, gpointer data)
+{
+	g_object_unref(palette->store);
+	g_free(palette);
+	palette = NULL;
+}
+
+// Show the quick open palette for fh
+void quick_open_show(Filehandler *fh)
+{
+	g_return_if_fail(fh != NULL);
+
+	// Without a directory, e.g. no file was browsed yet, only those indexed
+	//   before are searched
+	const gchar *dirname = filehandler_get_directory(fh);
+	if (dirname != NULL)
+		quick_open_add_root(dirname);
+
+	// Changes in roots too big to watch went unnoticed: index them again
+	GList *it;
+	for (it = roots; it != NULL; it = it->next)
+	{
+		IndexRoot *root = it->data;
+		if (!root->watched && !root->building)
+			start_build(root);
+	}
+
+	// Palette goes away with its window: one for another window is built anew
+	if (palette != NULL && palette->fh != fh)
+		gtk_widget_destroy(palette->window);
+
+	if (palette != NULL)
+	{
+		refresh_palette();
+		gtk_window_present(GTK_WINDOW(palette->window));
+		return;
+	}
+
+	palette = g_new0(Palette, 1);
+	palette->fh = fh;
+
+	palette->window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+	gtk_window_set_title(GTK_WINDOW(palette->window), _("Quick open"));
+	gtk_window_set_default_size(GTK_WINDOW(palette->window), 500, 350);
+	if (fh->main_window != NULL)
+	{
+		gtk_window_set_transient_for(GTK_WINDOW(palette->window), GTK_WINDOW(fh->main_window));
+		gtk_window_set_destroy_with_parent(GTK_WINDOW(palette->window), TRUE);
+		gtk_window_set_position(GTK_WINDOW(palette->window), GTK_WIN_POS_CENTER_ON_PARENT);
+	}
+
+	GtkWidget *vbox = gtk_vbox_new(FALSE, 4);
+	gtk_container_set_border_width(GTK_CONTAINER(vbox), 6);
+	gtk_container_add(GTK_CONTAINER(palette->window), vbox);
+
+	palette->entry = gtk_entry_new();
+	gtk_box_pack_start(GTK_BOX(vbox), palette->entry, FALSE, FALSE, 0);
+
+	palette->store = gtk_list_store_new(1, G_TYPE_STRING);
+	palette->view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(palette->store));
+	gtk_tree_view_set_headers_visible(GTK_TREE_VIEW(palette->view), FALSE);
+	gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(palette->view), -1, NULL,
+			gtk_cell_renderer_text_new(), "text", 0, NULL);
+
+	GtkWidget *scrolled = gtk_scrolled_window_new(NULL, NULL);
+	gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled),
+			GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+	gtk_container_add(GTK_CONTAINER(scrolled), palette->view);
+	gtk_box_pack_start(GTK_BOX(vbox), scrolled, TRUE, TRUE, 0);
+
+	palette->status = gtk_label_new(NULL);
+	gtk_misc_set_alignment(GTK_MISC(palette->status), 0.0, 0.5);
+	gtk_box_pack_start(GTK_BOX(vbox), palette->status, FALSE, FALSE, 0);
+
+	g_signal_connect(palette->entry, "changed", G_CALLBACK(on_palette_entry_changed), NULL);
+	g_signal_connect(palette->entry, "activate", G_CALLBACK(on_palette_entry_activate), NULL);
+	g_signal_connect(palette->entry, "key-press-event", G_CALLBACK(on_palette_key_press_event), NULL);
+	g_signal_connect(palette->view, "row-activated", G_CALLBACK(on_palette_row_activated), NULL);
+	g_signal_connect(palette->window, "destroy", G_CALLBACK(on_palette_destroy), NULL);
+
+	refresh_palette();
+	gtk_widget_show_all(palette->window);
+}
+
+G_MODULE_EXPORT
+void quick_open_on_action_activate(GtkAction *action, gpointer data)
+{
+	if (data == NULL)
+		return;
+
+	quick_open_show(data);
+}
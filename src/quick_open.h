@@ -0,0 +1,58 @@
+/*
+ * Copyright © 2011 Rodolfo Ribeiro Gomes <rodolforg arr0ba gmail.com>
+ *
+ * A file handler for GTK+
+ *
+    This file is part of GtkFileHandler.
+
+    GtkFileHandler is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GtkFileHandler is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GtkFileHandler.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef R_QUICK_OPEN_H_
+#define R_QUICK_OPEN_H_
+
+#include "gtk/gtk.h"
+
+#include "filehandler.h"
+
+// Quick open: find a file by typing a few letters of its name
+//   Files under the last browsed directory (and a few previous ones) are
+//   indexed on worker threads into a flat table of names, then kept up to
+//   date by watching the directories. A tree with more directories than
+//   can be watched is indexed again whenever the palette is shown instead.
+//   Queries are fuzzy: letters must appear in order, but not necessarily
+//   together.
+
+// Most recent directories kept indexed
+#define QUICK_OPEN_MAX_ROOTS 4
+// Files and directories walked per tree, at most: the rest is left out
+#define QUICK_OPEN_MAX_FILES 200000
+
+// Start indexing dirname in background, if it isn't yet
+//   It becomes the most recent root; the oldest one may be forgotten.
+void quick_open_add_root(const gchar *dirname);
+
+// Find files whose path matches query, best ones first
+//   Fills results with up to max_results full paths (free them with
+//   g_free()), and returns how many were found.
+guint quick_open_query(const gchar *query, gchar **results, guint max_results);
+
+// Show the quick open palette for fh
+//   Chosen file is opened by filehandler_open_file().
+void quick_open_show(Filehandler *fh);
+
+// GTK action callback: data must point to a Filehandler structure
+void quick_open_on_action_activate(GtkAction *action, gpointer data);
+
+#endif // R_QUICK_OPEN_H_
@@ -0,0 +1,232 @@
+/*
+ * Copyright © 2011 Rodolfo Ribeiro Gomes <rodolforg arr0ba gmail.com>
+ *
+ * A file handler for GTK+
+ *
+    This file is part of GtkFileHandler.
+
+    GtkFileHandler is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GtkFileHandler is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GtkFileHandler.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "session.h"
+
+#include <string.h>
+#include <glib/gi18n.h>
+#include <glib/gstdio.h>
+
+///////////////////////////////////
+// For internal use
+///////////////////////////////////
+
+// File layout (integers are 32-bit little-endian):
+//   magic, version, last_dir, active, document count, documents...
+//   where a string is its length followed by its bytes (no NUL)
+//   and a document is filename, cursor, top.
+static const gchar SESSION_MAGIC[4] = { 'F', 'H', 'S', 'N' };
+#define SESSION_VERSION 1
+
+static void put_int(GString *out, gint32 value)
+{
+	guint32 le = GUINT32_TO_LE((guint32) value);
+	g_string_append_len(out, (const gchar *) &le, sizeof(le));
+}
+
+static void put_string(GString *out, const gchar *str)
+{
+	gsize len = str != NULL ? strlen(str) : 0;
+	put_int(out, (gint32) len);
+	g_string_append_len(out, str, len);
+}
+
+// Reading cursor over loaded file contents
+typedef struct {
+	const gchar *pos;
+	const gchar *end;
+} Reader;
+
+static gboolean get_int(Reader *in, gint32 *value)
+{
+	guint32 le;
+	if (in->end - in->pos < (gssize) sizeof(le))
+		return FALSE;
+	memcpy(&le, in->pos, sizeof(le));
+	in->pos += sizeof(le);
+	*value = (gint32) GUINT32_FROM_LE(le);
+	return TRUE;
+}
+
+static gboolean get_string(Reader *in, gchar **str)
+{
+	gint32 len;
+	if (!get_int(in, &len) || len < 0 || in->end - in->pos < len)
+		return FALSE;
+	*str = len > 0 ? g_strndup(in->pos, len) : NULL;
+	in->pos += len;
+	return TRUE;
+}
+
+static void clear_document(gpointer data)
+{
+	SessionDocument *doc = data;
+	g_free(doc->filename);
+}
+
+///////////////////////////////////
+// Contructors & destructors
+///////////////////////////////////
+
+// Allocate an empty session
+Session *session_new(void)
+{
+	Session *session = g_new0(Session, 1);
+	session->documents = g_array_new(FALSE, TRUE, sizeof(SessionDocument));
+	session->active = -1;
+	return session;
+}
+
+// Properly desallocate a session
+void session_free(Session *session)
+{
+	if (session == NULL)
+		return;
+	session_clear(session);
+	g_array_free(session->documents, TRUE);
+	g_free(session);
+}
+
+///////////////////////////////////
+// Accessors & mutators
+///////////////////////////////////
+
+// Remember one more document
+void session_add_document(Session *session, const gchar *filename,
+		gint cursor, gint top, gboolean active)
+{
+	SessionDocument doc;
+
+	g_return_if_fail(session != NULL && filename != NULL);
+
+	doc.filename = g_strdup(filename);
+	doc.cursor = cursor;
+	doc.top = top;
+	g_array_append_val(session->documents, doc);
+
+	if (active)
+		session->active = session->documents->len - 1;
+}
+
+// Forget every document and last directory
+void session_clear(Session *session)
+{
+	guint n;
+	for (n = 0; n < session->documents->len; n++)
+		clear_document(&g_array_index(session->documents, SessionDocument, n));
+	g_array_set_size(session->documents, 0);
+	g_free(session->last_dir);
+	session->last_dir = NULL;
+	session->active = -1;
+}
+
+///////////////////////////////////
+// Load & save
+///////////////////////////////////
+
+// Where the session of this application is kept by default
+gchar *session_get_default_path(void)
+{
+	const gchar *prgname = g_get_prgname();
+	return g_build_filename(g_get_user_config_dir(),
+			prgname != NULL ? prgname : "filehandler", "session", NULL);
+}
+
+// Write a session to a compact binary file
+gboolean session_save(const Session *session, const gchar *path, GError **error)
+{
+	g_return_val_if_fail(session != NULL && path != NULL, FALSE);
+
+	GString *out = g_string_sized_new(256);
+	guint n;
+
+	g_string_append_len(out, SESSION_MAGIC, sizeof(SESSION_MAGIC));
+	put_int(out, SESSION_VERSION);
+	put_string(out, session->last_dir);
+	put_int(out, session->active);
+	put_int(out, session->documents->len);
+	for (n = 0; n < session->documents->len; n++)
+	{
+		const SessionDocument *doc = &g_array_index(session->documents, SessionDocument, n);
+		put_string(out, doc->filename);
+		put_int(out, doc->cursor);
+		put_int(out, doc->top);
+	}
+
+	gchar *dir = g_path_get_dirname(path);
+	g_mkdir_with_parents(dir, 0700);
+	g_free(dir);
+
+	gboolean ok = g_file_set_contents(path, out->str, out->len, error);
+	g_string_free(out, TRUE);
+	return ok;
+}
+
+// Read a session written by session_save()
+Session *session_load(const gchar *path, GError **error)
+{
+	g_return_val_if_fail(path != NULL, NULL);
+
+	gchar *contents;
+	gsize length;
+	if (!g_file_get_contents(path, &contents, &length, error))
+		return NULL;
+
+	Reader in = { contents, contents + length };
+	Session *session = session_new();
+	gint32 version, count, n;
+	gboolean ok = length >= sizeof(SESSION_MAGIC)
+			&& memcmp(contents, SESSION_MAGIC, sizeof(SESSION_MAGIC)) == 0;
+
+	if (ok)
+	{
+		in.pos += sizeof(SESSION_MAGIC);
+		ok = get_int(&in, &version) && version == SESSION_VERSION
+				&& get_string(&in, &session->last_dir)
+				&& get_int(&in, &session->active)
+				&& get_int(&in, &count) && count >= 0;
+	}
+
+	for (n = 0; ok && n < count; n++)
+	{
+		SessionDocument doc = { NULL, 0, 0 };
+		ok = get_string(&in, &doc.filename) && doc.filename != NULL
+				&& get_int(&in, &doc.cursor) && get_int(&in, &doc.top);
+		if (ok)
+			g_array_append_val(session->documents, doc);
+		else
+			g_free(doc.filename);
+	}
+
+	g_free(contents);
+
+	if (!ok)
+	{
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+				_("Session file \"%s\" is corrupted."), path);
+		session_free(session);
+		return NULL;
+	}
+
+	if (session->active >= (gint) session->documents->len)
+		session->active = -1;
+	return session;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright © 2011 Rodolfo Ribeiro Gomes <rodolforg arr0ba gmail.com>
+ *
+ * A file handler for GTK+
+ *
+    This file is part of GtkFileHandler.
+
+    GtkFileHandler is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GtkFileHandler is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GtkFileHandler.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef R_SESSION_H_
+#define R_SESSION_H_
+
+#include <glib.h>
+
+// A document remembered by a session
+//   cursor and top are character offsets: where the cursor was and
+//   which text was on top of the view.
+typedef struct {
+	gchar *filename;
+	gint cursor;
+	gint top;
+} SessionDocument;
+
+// What the user was working on when application quit
+//   documents is an array of SessionDocument; active is the index of the
+//   one the user was working on, or -1.
+typedef struct {
+	gchar *last_dir;
+	GArray *documents;
+	gint active;
+} Session;
+
+// Allocate an empty session
+Session *session_new(void);
+
+// Properly desallocate a session
+void session_free(Session *session);
+
+// Remember one more document
+//   If active is TRUE, it becomes the active one.
+void session_add_document(Session *session, const gchar *filename,
+		gint cursor, gint top, gboolean active);
+
+// Forget every document and last directory
+void session_clear(Session *session);
+
+// Where the session of this application is kept by default
+//   Free it with g_free().
+gchar *session_get_default_path(void);
+
+// Write a session to a compact binary file
+//   The file is replaced atomically.
+gboolean session_save(const Session *session, const gchar *path, GError **error);
+
+// Read a session written by session_save()
+//   Returns NULL if it doesn't exist or is corrupted.
+Session *session_load(const gchar *path, GError **error);
+
+#endif // R_SESSION_H_
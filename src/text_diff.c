@@ -0,0 +1,463 @@
+/*
+ * Copyright © 2011 Rodolfo Ribeiro Gomes <rodolforg arr0ba gmail.com>
+ *
+ * A file handler for GTK+
+ *
+    This file is part of GtkFileHandler.
+
+    GtkFileHandler is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GtkFileHandler is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GtkFileHandler.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "text_diff.h"
+#include "file_loader.h"
+
+#include <string.h>
+
+///////////////////////////////////
+// For internal use
+///////////////////////////////////
+
+// Lines of context around changes
+#define CONTEXT_LINES 3
+// Output is cut after so many lines
+#define MAX_OUTPUT_LINES 20000
+
+typedef struct {
+	const gchar *text;
+	gsize length;
+	guint hash;
+} Line;
+
+struct _TextDiff {
+	volatile gint ref;
+	volatile gint cancelled;
+
+	gchar *filename;
+	gchar *text;
+	gsize length;
+	GTimer *timer;
+	gdouble budget;
+
+	TextDiffHunkFunc hunk_func;
+	TextDiffDoneFunc done_func;
+	gpointer user_data;
+
+	// Used only by worker thread
+	GArray *a;
+	GArray *b;
+	gint *v1;
+	gint *v2;
+	gboolean truncated;
+	guint output_lines;
+
+	// Hunk being built, starting at line hunk_a of file (hunk_b of text)
+	GString *hunk;
+	gint hunk_a;
+	gint hunk_b;
+	gint hunk_a_lines;
+	gint hunk_b_lines;
+	// End of last change in file
+	gint last_a;
+};
+
+#define LINE(lines, n) (&g_array_index((lines), Line, (n)))
+
+static void diff_unref(TextDiff *diff)
+{
+	if (!g_atomic_int_dec_and_test(&diff->ref))
+		return;
+
+	g_timer_destroy(diff->timer);
+	g_free(diff->filename);
+	g_free(diff->text);
+	g_free(diff);
+}
+
+// A hunk or the end, sent to main loop
+typedef struct {
+	TextDiff *diff;
+	gchar *hunk;
+	gboolean complete;
+} DiffMessage;
+
+static gboolean deliver(gpointer data)
+{
+	DiffMessage *msg = data;
+	TextDiff *diff = msg->diff;
+
+	if (!g_atomic_int_get(&diff->cancelled))
+	{
+		if (msg->hunk != NULL)
+			diff->hunk_func(msg->hunk, diff->user_data);
+		else if (diff->done_func != NULL)
+			diff->done_func(msg->complete, diff->user_data);
+	}
+
+	g_free(msg->hunk);
+	diff_unref(diff);
+	g_free(msg);
+	return FALSE;
+}
+
+static void post(TextDiff *diff, gchar *hunk, gboolean complete)
+{
+	DiffMessage *msg = g_new(DiffMessage, 1);
+	g_atomic_int_inc(&diff->ref);
+	msg->diff = diff;
+	msg->hunk = hunk;
+	msg->complete = complete;
+	g_idle_add(deliver, msg);
+}
+
+// Lines without their ending (\n, \r\n or \r), so line endings don't count
+static GArray *split_lines(const gchar *text, gsize length)
+{
+	GArray *lines = g_array_new(FALSE, FALSE, sizeof(Line));
+	const gchar *end = text + length;
+
+	while (text < end)
+	{
+		Line line;
+		line.text = text;
+		line.hash = 5381;
+		while (text < end && *text != '\n' && *text != '\r')
+			line.hash = line.hash * 33 + (guchar) *text++;
+		line.length = text - line.text;
+		g_array_append_val(lines, line);
+
+		if (text < end && *text++ == '\r' && text < end && *text == '\n')
+			text++;
+	}
+	return lines;
+}
+
+static gboolean lines_equal(const Line *a, const Line *b)
+{
+	return a->hash == b->hash && a->length == b->length
+			&& memcmp(a->text, b->text, a->length) == 0;
+}
+
+#define EQUAL(diff, i, j) lines_equal(LINE((diff)->a, (i)), LINE((diff)->b, (j)))
+
+// Should it stop looking for the shortest diff?
+static gboolean out_of_time(TextDiff *diff)
+{
+	return diff->truncated || g_atomic_int_get(&diff->cancelled)
+			|| g_timer_elapsed(diff->timer, NULL) > diff->budget;
+}
+
+///////////////////////////////////
+// Hunks
+///////////////////////////////////
+
+static void append_line(TextDiff *diff, gchar prefix, const Line *line)
+{
+	if (++diff->output_lines > MAX_OUTPUT_LINES)
+	{
+		diff->truncated = TRUE;
+		return;
+	}
+
+	g_string_append_c(diff->hunk, prefix);
+	g_string_append_len(diff->hunk, line->text, line->length);
+	g_string_append_c(diff->hunk, '\n');
+}
+
+static void flush_hunk(TextDiff *diff)
+{
+	if (diff->hunk == NULL)
+		return;
+
+	// Context after last change
+	gint n, context = MIN(CONTEXT_LINES, (gint) diff->a->len - diff->last_a);
+	for (n = 0; n < context; n++)
+		append_line(diff, ' ', LINE(diff->a, diff->last_a + n));
+	diff->hunk_a_lines += context;
+	diff->hunk_b_lines += context;
+
+	post(diff, g_strdup_printf("@@ -%d,%d +%d,%d @@\n%s",
+			diff->hunk_a + 1, diff->hunk_a_lines, diff->hunk_b + 1, diff->hunk_b_lines,
+			diff->hunk->str), TRUE);
+	g_string_free(diff->hunk, TRUE);
+	diff->hunk = NULL;
+}
+
+// na lines at a0 of file were replaced by nb lines at b0 of text.
+//   Changes come in order, so a hunk is sent once the next change is far.
+static void emit_change(TextDiff *diff, gint a0, gint na, gint b0, gint nb)
+{
+	gint n;
+
+	if ((na == 0 && nb == 0) || diff->truncated)
+		return;
+
+	if (diff->hunk != NULL && a0 - diff->last_a > 2 * CONTEXT_LINES)
+		flush_hunk(diff);
+
+	if (diff->hunk == NULL)
+	{
+		gint context = MIN(CONTEXT_LINES, a0);
+		diff->hunk = g_string_new(NULL);
+		diff->hunk_a = diff->last_a = a0 - context;
+		diff->hunk_b = b0 - context;
+		diff->hunk_a_lines = diff->hunk_b_lines = 0;
+	}
+
+	// Unchanged lines since last change
+	for (n = diff->last_a; n < a0; n++)
+		append_line(diff, ' ', LINE(diff->a, n));
+	diff->hunk_a_lines += a0 - diff->last_a;
+	diff->hunk_b_lines += a0 - diff->last_a;
+
+	for (n = 0; n < na; n++)
+		append_line(diff, '-', LINE(diff->a, a0 + n));
+	for (n = 0; n < nb; n++)
+		append_line(diff, '+', LINE(diff->b, b0 + n));
+	diff->hunk_a_lines += na;
+	diff->hunk_b_lines += nb;
+	diff->last_a = a0 + na;
+}
+
+///////////////////////////////////
+// Myers' diff
+///////////////////////////////////
+
+// Find where the middle snake of an optimal path crosses, so each side can
+//   be compared apart, in linear space. Returns FALSE if time is over.
+static gboolean bisect(TextDiff *diff, gint a0, gint a1, gint b0, gint b1,
+		gint *x_out, gint *y_out)
+{
+	gint n = a1 - a0, m = b1 - b0;
+	gint max_d = (n + m + 1) / 2;
+	gint v_offset = max_d;
+	gint v_length = 2 * max_d + 2;
+	gint *v1 = diff->v1, *v2 = diff->v2;
+	gint i, d;
+
+	for (i = 0; i < v_length; i++)
+		v1[i] = v2[i] = -1;
+	v1[v_offset + 1] = 0;
+	v2[v_offset + 1] = 0;
+
+	gint delta = n - m;
+	// If the total number of characters is odd, front path will collide
+	gboolean front = (delta % 2 != 0);
+	gint k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+
+	for (d = 0; d < max_d; d++)
+	{
+		if (out_of_time(diff))
+			return FALSE;
+
+		gint k1, k2;
+		// Walk the front path one step
+		for (k1 = -d + k1start; k1 <= d - k1end; k1 += 2)
+		{
+			gint k1_offset = v_offset + k1;
+			gint x1;
+			if (k1 == -d || (k1 != d && v1[k1_offset - 1] < v1[k1_offset + 1]))
+				x1 = v1[k1_offset + 1];
+			else
+				x1 = v1[k1_offset - 1] + 1;
+			gint y1 = x1 - k1;
+			while (x1 < n && y1 < m && EQUAL(diff, a0 + x1, b0 + y1))
+			{
+				x1++;
+				y1++;
+			}
+			v1[k1_offset] = x1;
+
+			if (x1 > n)
+				k1end += 2;
+			else if (y1 > m)
+				k1start += 2;
+			else if (front)
+			{
+				gint k2_offset = v_offset + delta - k1;
+				if (k2_offset >= 0 && k2_offset < v_length && v2[k2_offset] != -1
+						&& x1 >= n - v2[k2_offset])
+				{
+					*x_out = x1;
+					*y_out = y1;
+					return TRUE;
+				}
+			}
+		}
+
+		// Walk the reverse path one step
+		for (k2 = -d + k2start; k2 <= d - k2end; k2 += 2)
+		{
+			gint k2_offset = v_offset + k2;
+			gint x2;
+			if (k2 == -d || (k2 != d && v2[k2_offset - 1] < v2[k2_offset + 1]))
+				x2 = v2[k2_offset + 1];
+			else
+				x2 = v2[k2_offset - 1] + 1;
+			gint y2 = x2 - k2;
+			while (x2 < n && y2 < m && EQUAL(diff, a1 - x2 - 1, b1 - y2 - 1))
+			{
+				x2++;
+				y2++;
+			}
+			v2[k2_offset] = x2;
+
+			if (x2 > n)
+				k2end += 2;
+			else if (y2 > m)
+				k2start += 2;
+			else if (!front)
+			{
+				gint k1_offset = v_offset + delta - k2;
+				if (k1_offset >= 0 && k1_offset < v_length && v1[k1_offset] != -1)
+				{
+					gint x1 = v1[k1_offset];
+					gint y1 = v_offset + x1 - k1_offset;
+					if (x1 >= n - x2)
+					{
+						*x_out = x1;
+						*y_out = y1;
+						return TRUE;
+					}
+				}
+			}
+		}
+	}
+	return FALSE;
+}
+
+// Compare lines a0..a1 of file to b0..b1 of text
+static void diff_range(TextDiff *diff, gint a0, gint a1, gint b0, gint b1)
+{
+	// Common prefix and suffix
+	while (a0 < a1 && b0 < b1 && EQUAL(diff, a0, b0))
+	{
+		a0++;
+		b0++;
+	}
+	while (a0 < a1 && b0 < b1 && EQUAL(diff, a1 - 1, b1 - 1))
+	{
+		a1--;
+		b1--;
+	}
+
+	gint x, y;
+	if (a0 == a1 || b0 == b1 || !bisect(diff, a0, a1, b0, b1, &x, &y)
+			|| (x == 0 && y == 0) || (x == a1 - a0 && y == b1 - b0))
+	{
+		// Nothing in common, or no time to find what is
+		emit_change(diff, a0, a1 - a0, b0, b1 - b0);
+		return;
+	}
+
+	diff_range(diff, a0, a0 + x, b0, b0 + y);
+	diff_range(diff, a0 + x, a1, b0 + y, b1);
+}
+
+static void run_diff(gpointer data, gpointer pool_data)
+{
+	TextDiff *diff = data;
+	gboolean complete = FALSE;
+
+	GMappedFile *file = g_mapped_file_new(diff->filename, FALSE, NULL);
+	if (file != NULL)
+	{
+		const gchar *contents = g_mapped_file_get_contents(file);
+		gsize length = g_mapped_file_get_length(file);
+		if (contents == NULL)
+			contents = "";
+
+		// Compare text as it would be read: in UTF-8
+		gchar *converted = NULL;
+		gboolean readable = TRUE;
+		if (!g_utf8_validate(contents, length, NULL))
+		{
+			converted = g_memdup(contents, length);
+			readable = file_loader_to_utf8(&converted, &length, NULL);
+			contents = converted;
+		}
+
+		if (readable)
+		{
+			diff->a = split_lines(contents, length);
+			diff->b = split_lines(diff->text, diff->length);
+			diff->v1 = g_new(gint, diff->a->len + diff->b->len + 4);
+			diff->v2 = g_new(gint, diff->a->len + diff->b->len + 4);
+
+			diff_range(diff, 0, diff->a->len, 0, diff->b->len);
+			flush_hunk(diff);
+			complete = !diff->truncated;
+
+			g_free(diff->v1);
+			g_free(diff->v2);
+			g_array_free(diff->a, TRUE);
+			g_array_free(diff->b, TRUE);
+		}
+		g_free(converted);
+#if GLIB_CHECK_VERSION(2,22,0)
+		g_mapped_file_unref(file);
+#else
+		g_mapped_file_free(file);
+#endif
+	}
+
+	post(diff, NULL, complete);
+	diff_unref(diff);
+}
+
+///////////////////////////////////
+// Public functions
+///////////////////////////////////
+
+// Start comparing filename to text
+TextDiff *text_diff_start(const gchar *filename, gchar *text, gsize length,
+		guint time_budget, TextDiffHunkFunc hunk, TextDiffDoneFunc done,
+		gpointer user_data)
+{
+	static GThreadPool *pool = NULL;
+
+	g_return_val_if_fail(filename != NULL && text != NULL && hunk != NULL, NULL);
+
+	if (pool == NULL)
+	{
+#if !GLIB_CHECK_VERSION(2,32,0)
+		if (!g_thread_supported())
+			g_thread_init(NULL);
+#endif
+		pool = g_thread_pool_new(run_diff, NULL, -1, FALSE, NULL);
+	}
+
+	TextDiff *diff = g_new0(TextDiff, 1);
+	// One for the caller, one for the worker
+	diff->ref = 2;
+	diff->filename = g_strdup(filename);
+	diff->text = text;
+	diff->length = length;
+	diff->timer = g_timer_new();
+	diff->budget = time_budget / 1000.0;
+	diff->hunk_func = hunk;
+	diff->done_func = done;
+	diff->user_data = user_data;
+
+	g_thread_pool_push(pool, diff, NULL);
+	return diff;
+}
+
+// Stop it: no function is called back after this
+void text_diff_cancel(TextDiff *diff)
+{
+	if (diff == NULL)
+		return;
+	g_atomic_int_set(&diff->cancelled, TRUE);
+	diff_unref(diff);
+}
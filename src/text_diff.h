@@ -0,0 +1,51 @@
+/*
+ * Copyright © 2011 Rodolfo Ribeiro Gomes <rodolforg arr0ba gmail.com>
+ *
+ * A file handler for GTK+
+ *
+    This file is part of GtkFileHandler.
+
+    GtkFileHandler is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GtkFileHandler is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GtkFileHandler.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef R_TEXT_DIFF_H_
+#define R_TEXT_DIFF_H_
+
+#include <glib.h>
+
+// Line by line differences between a file and a text, in unified format
+//   The file is mapped, not read (if it isn't in UTF-8, it's converted as
+//   file_loader would), and the diff (Myers' algorithm, in linear space)
+//   runs on a worker thread. Line endings don't count. Hunks are handed to
+//   main loop as soon as each one is found. After time_budget milliseconds,
+//   what is left is compared coarsely (as a whole replaced block) so it
+//   always ends soon.
+typedef struct _TextDiff TextDiff;
+
+// Called from main loop with each hunk ("@@ -1,3 +1,4 @@" and its lines)
+typedef void (*TextDiffHunkFunc)(const gchar *hunk, gpointer user_data);
+
+// Called from main loop at the end. complete is FALSE if the file couldn't
+//   be read or the output was too long, so not all hunks were given.
+typedef void (*TextDiffDoneFunc)(gboolean complete, gpointer user_data);
+
+// Start comparing filename to text (which is taken, and freed with g_free)
+TextDiff *text_diff_start(const gchar *filename, gchar *text, gsize length,
+		guint time_budget, TextDiffHunkFunc hunk, TextDiffDoneFunc done,
+		gpointer user_data);
+
+// Stop it: no function is called back after this
+void text_diff_cancel(TextDiff *diff);
+
+#endif // R_TEXT_DIFF_H_
@@ -0,0 +1,829 @@
+/*
+ * Copyright © 2011 Rodolfo Ribeiro Gomes <rodolforg arr0ba gmail.com>
+ *
+ * A file handler for GTK+
+ *
+    This file is part of GtkFileHandler.
+
+    GtkFileHandler is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GtkFileHandler is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GtkFileHandler.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "text_snapshot.h"
+
+#include <string.h>
+
+///////////////////////////////////
+// For internal use
+///////////////////////////////////
+
+// Segments are cut at this size, and split when they grow beyond twice it
+#define SEGMENT_SIZE (64 * 1024)
+#define SEGMENT_MAX (2 * SEGMENT_SIZE)
+
+// Beyond these, changes are better saved by rewriting the whole file
+#define CHANGES_MAX_RANGES 1024
+#define CHANGES_MAX_BYTES (16 * 1024 * 1024)
+
+typedef struct {
+	volatile gint ref;
+	gsize bytes;
+	gsize chars;
+	gsize size;
+	gchar *data;
+} Segment;
+
+// Bytes changed since text was saved, in current offsets
+typedef struct {
+	gsize start;
+	gsize end;
+} ByteRange;
+
+typedef struct {
+	// ByteRange, sorted and apart from each other
+	GArray *ranges;
+	// From here to the end everything moved; G_MAXSIZE if nothing did
+	gsize tail;
+	// Length of text when it was saved
+	gsize base_length;
+	// File it was saved to, as it was right then
+	IoEngineFileId file;
+	// Last edit changed text length; but next one may undo it, e.g.
+	//   typing over a selection of same size deletes and then inserts.
+	gboolean pending;
+	gsize pending_offset;
+	gssize pending_delta;
+} ChangeSet;
+
+struct _TextMirror {
+	GtkTextBuffer *buffer;
+	GPtrArray *segments;
+	gsize bytes;
+	gulong handlers[2];
+
+	// NULL if changes aren't tracked
+	ChangeSet *changes;
+	// Changes since the snapshot being saved
+	ChangeSet *saving_changes;
+
+	// Marks right before each soft break, in buffer order
+	GPtrArray *soft_breaks;
+	// Text being set is mirrored by hand
+	gboolean setting_text;
+	gboolean frozen;
+};
+
+struct _TextSnapshot {
+	Segment **segments;
+	guint n_segments;
+	gsize bytes;
+	ChangeSet *changes;
+	// File snapshot was written to, right after that
+	IoEngineFileId file;
+	gboolean written;
+};
+
+#define SEGMENT(m, n) ((Segment *) g_ptr_array_index((m)->segments, (n)))
+
+#define SOFT_BREAK_TAG "soft-break"
+
+static Segment *segment_new(const gchar *text, gsize bytes, gsize chars)
+{
+	Segment *seg = g_new(Segment, 1);
+	seg->ref = 1;
+	seg->bytes = bytes;
+	seg->chars = chars;
+	seg->size = MAX(bytes, 64);
+	seg->data = g_malloc(seg->size);
+	memcpy(seg->data, text, bytes);
+	return seg;
+}
+
+static void segment_unref(Segment *seg)
+{
+	if (g_atomic_int_dec_and_test(&seg->ref))
+	{
+		g_free(seg->data);
+		g_free(seg);
+	}
+}
+
+// Segment n, copied first if a snapshot shares it
+static Segment *writable_segment(TextMirror *mirror, guint n)
+{
+	Segment *seg = SEGMENT(mirror, n);
+	if (g_atomic_int_get(&seg->ref) == 1)
+		return seg;
+
+	Segment *copy = segment_new(seg->data, seg->bytes, seg->chars);
+	g_ptr_array_index(mirror->segments, n) = copy;
+	segment_unref(seg);
+	return copy;
+}
+
+// Where a character offset falls: segment index and offset inside it.
+//   Offset at the very end goes to the end of last segment.
+static guint locate(TextMirror *mirror, gsize offset, gsize *in_segment)
+{
+	guint n;
+	for (n = 0; n < mirror->segments->len; n++)
+	{
+		Segment *seg = SEGMENT(mirror, n);
+		if (offset < seg->chars || n + 1 == mirror->segments->len)
+		{
+			*in_segment = MIN(offset, seg->chars);
+			return n;
+		}
+		offset -= seg->chars;
+	}
+	*in_segment = 0;
+	return 0;
+}
+
+// Byte offset of a character offset inside a segment
+static gsize byte_offset(const Segment *seg, gsize chars)
+{
+	if (chars >= seg->chars)
+		return seg->bytes;
+	return g_utf8_offset_to_pointer(seg->data, chars) - seg->data;
+}
+
+// Add text as new segments at index n, cut at character boundaries
+static void insert_segments(TextMirror *mirror, guint n, const gchar *text, gsize bytes)
+{
+	while (bytes > 0)
+	{
+		gsize cut = MIN(bytes, SEGMENT_SIZE);
+		// Don't split a character
+		while (cut < bytes && (text[cut] & 0xC0) == 0x80)
+			cut--;
+		if (cut == 0)
+			cut = bytes;
+
+		Segment *seg = segment_new(text, cut, g_utf8_strlen(text, cut));
+		g_ptr_array_add(mirror->segments, seg);
+		// Move it to index n
+		memmove(&mirror->segments->pdata[n + 1], &mirror->segments->pdata[n],
+				(mirror->segments->len - 1 - n) * sizeof(gpointer));
+		mirror->segments->pdata[n++] = seg;
+
+		text += cut;
+		bytes -= cut;
+	}
+}
+
+static void mirror_insert(TextMirror *mirror, gsize offset, const gchar *text, gsize bytes)
+{
+	mirror->bytes += bytes;
+
+	if (mirror->segments->len == 0)
+	{
+		insert_segments(mirror, 0, text, bytes);
+		return;
+	}
+
+	gsize in_segment;
+	guint n = locate(mirror, offset, &in_segment);
+	Segment *seg = writable_segment(mirror, n);
+	gsize at = byte_offset(seg, in_segment);
+
+	if (seg->bytes + bytes <= SEGMENT_MAX)
+	{
+		if (seg->bytes + bytes > seg->size)
+		{
+			seg->size = MAX(seg->size * 2, seg->bytes + bytes);
+			seg->data = g_realloc(seg->data, seg->size);
+		}
+		memmove(seg->data + at + bytes, seg->data + at, seg->bytes - at);
+		memcpy(seg->data + at, text, bytes);
+		seg->bytes += bytes;
+		seg->chars += g_utf8_strlen(text, bytes);
+		return;
+	}
+
+	// Too big: split segment at insertion point and put text in between
+	if (at < seg->bytes)
+	{
+		gsize tail_chars = seg->chars - in_segment;
+		Segment *tail = segment_new(seg->data + at, seg->bytes - at, tail_chars);
+		seg->bytes = at;
+		seg->chars = in_segment;
+		g_ptr_array_add(mirror->segments, tail);
+		memmove(&mirror->segments->pdata[n + 2], &mirror->segments->pdata[n + 1],
+				(mirror->segments->len - 2 - n) * sizeof(gpointer));
+		mirror->segments->pdata[n + 1] = tail;
+	}
+	insert_segments(mirror, n + 1, text, bytes);
+}
+
+static void mirror_delete(TextMirror *mirror, gsize offset, gsize chars)
+{
+	gsize in_segment;
+	guint n = locate(mirror, offset, &in_segment);
+
+	while (chars > 0 && n < mirror->segments->len)
+	{
+		Segment *seg = SEGMENT(mirror, n);
+		gsize take = MIN(seg->chars - in_segment, chars);
+
+		if (in_segment == 0 && take == seg->chars)
+		{
+			// Whole segment goes away
+			mirror->bytes -= seg->bytes;
+			g_ptr_array_remove_index(mirror->segments, n);
+			segment_unref(seg);
+		}
+		else
+		{
+			seg = writable_segment(mirror, n);
+			gsize from = byte_offset(seg, in_segment);
+			gsize to = byte_offset(seg, in_segment + take);
+			memmove(seg->data + from, seg->data + to, seg->bytes - to);
+			seg->bytes -= to - from;
+			seg->chars -= take;
+			mirror->bytes -= to - from;
+			n++;
+		}
+		chars -= take;
+		in_segment = 0;
+	}
+}
+
+static ChangeSet *changes_new(gsize base_length, gsize tail)
+{
+	ChangeSet *changes = g_new0(ChangeSet, 1);
+	changes->ranges = g_array_new(FALSE, FALSE, sizeof(ByteRange));
+	changes->tail = tail;
+	changes->base_length = base_length;
+	return changes;
+}
+
+// Changes are from file as it is now; if it can't be told, whole text is
+//   changed, so it's never patched in place
+static void changes_set_file(ChangeSet *changes, const IoEngineFileId *file)
+{
+	if (file != NULL && file->size == changes->base_length)
+		changes->file = *file;
+	else
+		changes->tail = 0;
+}
+
+static ChangeSet *changes_copy(const ChangeSet *changes)
+{
+	ChangeSet *copy = g_memdup(changes, sizeof(ChangeSet));
+	copy->ranges = g_array_sized_new(FALSE, FALSE, sizeof(ByteRange), changes->ranges->len);
+	g_array_append_vals(copy->ranges, changes->ranges->data, changes->ranges->len);
+	return copy;
+}
+
+static void changes_free(ChangeSet *changes)
+{
+	if (changes == NULL)
+		return;
+	g_array_free(changes->ranges, TRUE);
+	g_free(changes);
+}
+
+// Where text starts to differ from the saved one until its end
+static gsize changes_tail(const ChangeSet *changes)
+{
+	return changes->pending ? MIN(changes->tail, changes->pending_offset) : changes->tail;
+}
+
+// Text length changed at offset by delta bytes
+static void changes_shift(ChangeSet *changes, gsize offset, gssize delta)
+{
+	if (changes->pending && changes->pending_offset == offset
+			&& changes->pending_delta + delta == 0)
+	{
+		changes->pending = FALSE;
+		return;
+	}
+	changes->tail = changes_tail(changes);
+	changes->pending = TRUE;
+	changes->pending_offset = offset;
+	changes->pending_delta = delta;
+}
+
+static void changes_add_range(ChangeSet *changes, gsize start, gsize end)
+{
+	GArray *ranges = changes->ranges;
+	guint n = 0;
+
+	while (n < ranges->len && g_array_index(ranges, ByteRange, n).end < start)
+		n++;
+	// Merge with those it touches
+	while (n < ranges->len && g_array_index(ranges, ByteRange, n).start <= end)
+	{
+		ByteRange *r = &g_array_index(ranges, ByteRange, n);
+		start = MIN(start, r->start);
+		end = MAX(end, r->end);
+		g_array_remove_index(ranges, n);
+	}
+	ByteRange range = { start, end };
+	g_array_insert_val(ranges, n, range);
+
+	// Too scattered: take everything from first change as changed
+	if (ranges->len > CHANGES_MAX_RANGES)
+	{
+		changes->tail = MIN(changes->tail, g_array_index(ranges, ByteRange, 0).start);
+		g_array_set_size(ranges, 0);
+	}
+}
+
+static void changes_insert(ChangeSet *changes, gsize offset, gsize bytes)
+{
+	guint n;
+
+	changes_shift(changes, offset, bytes);
+	for (n = 0; n < changes->ranges->len; n++)
+	{
+		ByteRange *r = &g_array_index(changes->ranges, ByteRange, n);
+		if (r->start >= offset)
+		{
+			r->start += bytes;
+			r->end += bytes;
+		}
+		else if (r->end > offset)
+			r->end += bytes;
+	}
+	if (changes->tail != G_MAXSIZE && changes->tail > offset)
+		changes->tail += bytes;
+	changes_add_range(changes, offset, offset + bytes);
+}
+
+static void changes_delete(ChangeSet *changes, gsize offset, gsize bytes)
+{
+	gsize end = offset + bytes;
+	guint n = 0;
+
+	changes_shift(changes, offset, -(gssize) bytes);
+	while (n < changes->ranges->len)
+	{
+		ByteRange *r = &g_array_index(changes->ranges, ByteRange, n);
+		r->start = r->start >= end ? r->start - bytes : MIN(r->start, offset);
+		r->end = r->end >= end ? r->end - bytes : MIN(r->end, offset);
+		if (r->start == r->end)
+			g_array_remove_index(changes->ranges, n);
+		else
+			n++;
+	}
+	if (changes->tail != G_MAXSIZE)
+		changes->tail = changes->tail >= end ? changes->tail - bytes : MIN(changes->tail, offset);
+}
+
+// Byte offset of a character offset in whole text
+static gsize text_byte_offset(TextMirror *mirror, gsize offset)
+{
+	gsize bytes = 0;
+	guint n;
+	for (n = 0; n < mirror->segments->len; n++)
+	{
+		Segment *seg = SEGMENT(mirror, n);
+		if (offset <= seg->chars)
+			return bytes + byte_offset(seg, offset);
+		offset -= seg->chars;
+		bytes += seg->bytes;
+	}
+	return bytes;
+}
+
+static void track_insert(TextMirror *mirror, gsize offset, gsize bytes)
+{
+	if (mirror->changes == NULL)
+		return;
+	gsize at = text_byte_offset(mirror, offset);
+	changes_insert(mirror->changes, at, bytes);
+	if (mirror->saving_changes != NULL)
+		changes_insert(mirror->saving_changes, at, bytes);
+}
+
+static void track_delete(TextMirror *mirror, gsize offset, gsize chars)
+{
+	if (mirror->changes == NULL)
+		return;
+	gsize from = text_byte_offset(mirror, offset);
+	gsize bytes = text_byte_offset(mirror, offset + chars) - from;
+	changes_delete(mirror->changes, from, bytes);
+	if (mirror->saving_changes != NULL)
+		changes_delete(mirror->saving_changes, from, bytes);
+}
+
+// How many soft breaks are before a buffer offset
+static guint soft_breaks_before(TextMirror *mirror, gint offset)
+{
+	guint low = 0, high = mirror->soft_breaks->len;
+	while (low < high)
+	{
+		guint middle = (low + high) / 2;
+		GtkTextIter iter;
+		gtk_text_buffer_get_iter_at_mark(mirror->buffer, &iter,
+				g_ptr_array_index(mirror->soft_breaks, middle));
+		if (gtk_text_iter_get_offset(&iter) < offset)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+static void on_insert_text(GtkTextBuffer *buffer, GtkTextIter *location,
+		gchar *text, gint len, gpointer data)
+{
+	TextMirror *mirror = data;
+	if (mirror->setting_text)
+		return;
+
+	if (len < 0)
+		len = strlen(text);
+	gint offset = gtk_text_iter_get_offset(location);
+	offset -= soft_breaks_before(mirror, offset);
+	track_insert(mirror, offset, len);
+	mirror_insert(mirror, offset, text, len);
+}
+
+static void on_delete_range(GtkTextBuffer *buffer, GtkTextIter *start,
+		GtkTextIter *end, gpointer data)
+{
+	TextMirror *mirror = data;
+	gint from = gtk_text_iter_get_offset(start);
+	gint to = gtk_text_iter_get_offset(end);
+
+	// Soft breaks going away with the range aren't text
+	guint first = soft_breaks_before(mirror, from);
+	guint last = soft_breaks_before(mirror, to);
+	guint n;
+	for (n = first; n < last; n++)
+		gtk_text_buffer_delete_mark(buffer, g_ptr_array_index(mirror->soft_breaks, n));
+	if (last > first)
+		g_ptr_array_remove_range(mirror->soft_breaks, first, last - first);
+
+	from -= first;
+	to -= last;
+	track_delete(mirror, from, to - from);
+	mirror_delete(mirror, from, to - from);
+}
+
+static void clear_soft_breaks(TextMirror *mirror)
+{
+	guint n;
+	for (n = 0; n < mirror->soft_breaks->len; n++)
+		gtk_text_buffer_delete_mark(mirror->buffer, g_ptr_array_index(mirror->soft_breaks, n));
+	g_ptr_array_set_size(mirror->soft_breaks, 0);
+}
+
+///////////////////////////////////
+// Mirror
+///////////////////////////////////
+
+// Start following buffer
+TextMirror *text_mirror_new(GtkTextBuffer *buffer)
+{
+	g_return_val_if_fail(buffer != NULL, NULL);
+
+	TextMirror *mirror = g_new0(TextMirror, 1);
+	mirror->buffer = g_object_ref(buffer);
+	mirror->segments = g_ptr_array_new();
+	mirror->soft_breaks = g_ptr_array_new();
+
+	GtkTextIter start, end;
+	gtk_text_buffer_get_bounds(buffer, &start, &end);
+	gchar *text = gtk_text_buffer_get_slice(buffer, &start, &end, TRUE);
+	mirror_insert(mirror, 0, text, strlen(text));
+	g_free(text);
+
+	mirror->handlers[0] = g_signal_connect(buffer, "insert-text",
+			G_CALLBACK(on_insert_text), mirror);
+	mirror->handlers[1] = g_signal_connect(buffer, "delete-range",
+			G_CALLBACK(on_delete_range), mirror);
+	return mirror;
+}
+
+// Stop following buffer
+void text_mirror_destroy(TextMirror *mirror)
+{
+	if (mirror == NULL)
+		return;
+
+	g_signal_handler_disconnect(mirror->buffer, mirror->handlers[0]);
+	g_signal_handler_disconnect(mirror->buffer, mirror->handlers[1]);
+	clear_soft_breaks(mirror);
+	g_ptr_array_free(mirror->soft_breaks, TRUE);
+	g_object_unref(mirror->buffer);
+
+	g_ptr_array_foreach(mirror->segments, (GFunc) segment_unref, NULL);
+	g_ptr_array_free(mirror->segments, TRUE);
+	changes_free(mirror->changes);
+	changes_free(mirror->saving_changes);
+	g_free(mirror);
+}
+
+gsize text_mirror_get_length(const TextMirror *mirror)
+{
+	return mirror != NULL ? mirror->bytes : 0;
+}
+
+// Copy of buffer text as it is now
+TextSnapshot *text_mirror_snapshot(TextMirror *mirror)
+{
+	g_return_val_if_fail(mirror != NULL, NULL);
+
+	TextSnapshot *snapshot = g_new0(TextSnapshot, 1);
+	guint n;
+
+	snapshot->n_segments = mirror->segments->len;
+	snapshot->segments = g_new(Segment *, snapshot->n_segments);
+	snapshot->bytes = mirror->bytes;
+	for (n = 0; n < snapshot->n_segments; n++)
+	{
+		snapshot->segments[n] = SEGMENT(mirror, n);
+		g_atomic_int_inc(&snapshot->segments[n]->ref);
+	}
+	return snapshot;
+}
+
+// Track bytes changed from now on
+//   Until text_mirror_set_saved() is called, the whole text is changed.
+void text_mirror_track_changes(TextMirror *mirror)
+{
+	g_return_if_fail(mirror != NULL);
+	if (mirror->changes == NULL)
+		mirror->changes = changes_new(mirror->bytes, 0);
+}
+
+// Text is the same as the file now
+void text_mirror_set_saved(TextMirror *mirror, const IoEngineFileId *file)
+{
+	g_return_if_fail(mirror != NULL);
+	if (mirror->changes == NULL)
+		return;
+
+	changes_free(mirror->changes);
+	changes_free(mirror->saving_changes);
+	mirror->changes = changes_new(mirror->bytes, G_MAXSIZE);
+	changes_set_file(mirror->changes, file);
+	mirror->saving_changes = NULL;
+}
+
+// Snapshot to be saved, with the changes it brings
+TextSnapshot *text_mirror_begin_save(TextMirror *mirror)
+{
+	TextSnapshot *snapshot = text_mirror_snapshot(mirror);
+	if (snapshot == NULL || mirror->changes == NULL)
+		return snapshot;
+
+	snapshot->changes = changes_copy(mirror->changes);
+	changes_free(mirror->saving_changes);
+	mirror->saving_changes = changes_new(mirror->bytes, G_MAXSIZE);
+	return snapshot;
+}
+
+// Snapshot was saved, if written: later changes are what's left to save
+void text_mirror_end_save(TextMirror *mirror, const TextSnapshot *snapshot,
+		gboolean written)
+{
+	g_return_if_fail(mirror != NULL && snapshot != NULL);
+	// Saved as something else meanwhile?
+	if (mirror->saving_changes == NULL)
+		return;
+
+	if (written)
+	{
+		changes_free(mirror->changes);
+		mirror->changes = mirror->saving_changes;
+		changes_set_file(mirror->changes, snapshot->written ? &snapshot->file : NULL);
+	}
+	else
+		changes_free(mirror->saving_changes);
+	mirror->saving_changes = NULL;
+}
+
+// Set buffer text, split by soft breaks at character offsets of text
+//   Text is set at once, so each segment is a line of its own in buffer:
+//   long lines are never held whole by it.
+void text_mirror_set_text(TextMirror *mirror, const gchar *text, gsize length,
+		const GArray *soft_breaks)
+{
+	g_return_if_fail(mirror != NULL);
+
+	if (soft_breaks == NULL || soft_breaks->len == 0)
+	{
+		gtk_text_buffer_set_text(mirror->buffer, text, length);
+		return;
+	}
+
+	GString *shown = g_string_sized_new(length + soft_breaks->len);
+	const gchar *p = text;
+	gsize chars = 0;
+	guint n;
+	for (n = 0; n < soft_breaks->len; n++)
+	{
+		gsize offset = g_array_index(soft_breaks, gsize, n);
+		const gchar *at = g_utf8_offset_to_pointer(p, offset - chars);
+		g_string_append_len(shown, p, at - p);
+		g_string_append_c(shown, '\n');
+		p = at;
+		chars = offset;
+	}
+	g_string_append_len(shown, p, text + length - p);
+
+	// Old text is deleted as usual; new one is mirrored without soft breaks
+	mirror->setting_text = TRUE;
+	gtk_text_buffer_set_text(mirror->buffer, shown->str, shown->len);
+	mirror->setting_text = FALSE;
+	g_string_free(shown, TRUE);
+	if (!mirror->frozen)
+	{
+		track_insert(mirror, 0, length);
+		mirror_insert(mirror, 0, text, length);
+	}
+
+	GtkTextTag *tag = gtk_text_tag_table_lookup(
+			gtk_text_buffer_get_tag_table(mirror->buffer), SOFT_BREAK_TAG);
+	if (tag == NULL)
+		tag = gtk_text_buffer_create_tag(mirror->buffer, SOFT_BREAK_TAG,
+				"editable", FALSE, NULL);
+
+	for (n = 0; n < soft_breaks->len; n++)
+	{
+		// Each soft break before moves text one character forward
+		GtkTextIter start, end;
+		gtk_text_buffer_get_iter_at_offset(mirror->buffer, &start,
+				g_array_index(soft_breaks, gsize, n) + n);
+		end = start;
+		gtk_text_iter_forward_char(&end);
+		gtk_text_buffer_apply_tag(mirror->buffer, tag, &start, &end);
+		// Text typed right before it pushes the mark along
+		g_ptr_array_add(mirror->soft_breaks,
+				gtk_text_buffer_create_mark(mirror->buffer, NULL, &start, FALSE));
+	}
+}
+
+// Stop following buffer for a while
+void text_mirror_freeze(TextMirror *mirror)
+{
+	g_return_if_fail(mirror != NULL);
+	if (mirror->frozen)
+		return;
+
+	clear_soft_breaks(mirror);
+	g_signal_handler_block(mirror->buffer, mirror->handlers[0]);
+	g_signal_handler_block(mirror->buffer, mirror->handlers[1]);
+	mirror->frozen = TRUE;
+}
+
+// Follow buffer again
+void text_mirror_thaw(TextMirror *mirror)
+{
+	g_return_if_fail(mirror != NULL);
+	if (!mirror->frozen)
+		return;
+
+	g_signal_handler_unblock(mirror->buffer, mirror->handlers[0]);
+	g_signal_handler_unblock(mirror->buffer, mirror->handlers[1]);
+	mirror->frozen = FALSE;
+}
+
+gboolean text_mirror_is_frozen(const TextMirror *mirror)
+{
+	return mirror != NULL && mirror->frozen;
+}
+
+///////////////////////////////////
+// Snapshot
+///////////////////////////////////
+
+gsize text_snapshot_get_length(const TextSnapshot *snapshot)
+{
+	return snapshot != NULL ? snapshot->bytes : 0;
+}
+
+// Snapshot text in a single NUL-terminated string
+gchar *text_snapshot_flatten(const TextSnapshot *snapshot, gsize *length)
+{
+	g_return_val_if_fail(snapshot != NULL, NULL);
+
+	gchar *text = g_malloc(snapshot->bytes + 1);
+	gsize pos = 0;
+	guint n;
+
+	for (n = 0; n < snapshot->n_segments; n++)
+	{
+		memcpy(text + pos, snapshot->segments[n]->data, snapshot->segments[n]->bytes);
+		pos += snapshot->segments[n]->bytes;
+	}
+	text[pos] = '\0';
+
+	if (length != NULL)
+		*length = pos;
+	return text;
+}
+
+// Copy length bytes of text from offset
+static void snapshot_copy(const TextSnapshot *snapshot, gsize offset, gsize length, gchar *dest)
+{
+	guint n;
+	for (n = 0; n < snapshot->n_segments && length > 0; n++)
+	{
+		const Segment *seg = snapshot->segments[n];
+		if (offset >= seg->bytes)
+		{
+			offset -= seg->bytes;
+			continue;
+		}
+		gsize take = MIN(seg->bytes - offset, length);
+		memcpy(dest, seg->data + offset, take);
+		dest += take;
+		length -= take;
+		offset = 0;
+	}
+}
+
+// Snapshot was just written to filename
+void text_snapshot_set_written(TextSnapshot *snapshot, const gchar *filename)
+{
+	g_return_if_fail(snapshot != NULL && filename != NULL);
+
+	snapshot->written = io_engine_get_file_id(filename, &snapshot->file)
+			&& snapshot->file.size == snapshot->bytes;
+}
+
+// What changed since text was saved
+gboolean text_snapshot_get_changes(const TextSnapshot *snapshot, GArray **ranges,
+		gchar **data, IoEngineFileId *file)
+{
+	g_return_val_if_fail(snapshot != NULL && ranges != NULL && data != NULL, FALSE);
+
+	const ChangeSet *changes = snapshot->changes;
+	if (changes == NULL)
+		return FALSE;
+
+	gsize tail = changes_tail(changes);
+	gsize total = tail < snapshot->bytes ? snapshot->bytes - tail : 0;
+	guint n;
+	for (n = 0; n < changes->ranges->len; n++)
+	{
+		const ByteRange *r = &g_array_index(changes->ranges, ByteRange, n);
+		if (r->start < tail)
+			total += MIN(r->end, tail) - r->start;
+	}
+
+	// Not worth it: a full rewrite is safer
+	if (total > CHANGES_MAX_BYTES || total > snapshot->bytes / 4)
+		return FALSE;
+
+	*ranges = g_array_new(FALSE, FALSE, sizeof(IoEngineRange));
+	*data = g_malloc(MAX(total, 1));
+	gchar *dest = *data;
+	for (n = 0; n <= changes->ranges->len; n++)
+	{
+		IoEngineRange range;
+		if (n < changes->ranges->len)
+		{
+			const ByteRange *r = &g_array_index(changes->ranges, ByteRange, n);
+			if (r->start >= tail)
+				continue;
+			range.offset = r->start;
+			range.length = MIN(r->end, tail) - r->start;
+		}
+		else if (tail < snapshot->bytes)
+		{
+			range.offset = tail;
+			range.length = snapshot->bytes - tail;
+		}
+		else
+			break;
+
+		snapshot_copy(snapshot, range.offset, range.length, dest);
+		range.data = dest;
+		dest += range.length;
+		g_array_append_val(*ranges, range);
+	}
+
+	if (file != NULL)
+		*file = changes->file;
+	return TRUE;
+}
+
+void text_snapshot_free(TextSnapshot *snapshot)
+{
+	if (snapshot == NULL)
+		return;
+
+	guint n;
+	for (n = 0; n < snapshot->n_segments; n++)
+		segment_unref(snapshot->segments[n]);
+	g_free(snapshot->segments);
+	changes_free(snapshot->changes);
+	g_free(snapshot);
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright © 2011 Rodolfo Ribeiro Gomes <rodolforg arr0ba gmail.com>
+ *
+ * A file handler for GTK+
+ *
+    This file is part of GtkFileHandler.
+
+    GtkFileHandler is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GtkFileHandler is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GtkFileHandler.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef R_TEXT_SNAPSHOT_H_
+#define R_TEXT_SNAPSHOT_H_
+
+#include "gtk/gtk.h"
+#include "io_engine.h"
+
+// Point-in-time copies of a GtkTextBuffer, cheap to take
+//   A TextMirror follows every edit of a (plain text) buffer and keeps its
+//   text split in reference-counted segments. A snapshot just references
+//   current segments; a segment shared with a snapshot is copied only when
+//   an edit touches it. So taking a snapshot costs a few pointers per
+//   segment, and a snapshot can be read from another thread while the user
+//   keeps editing the buffer.
+typedef struct _TextMirror TextMirror;
+typedef struct _TextSnapshot TextSnapshot;
+
+// Start following buffer
+TextMirror *text_mirror_new(GtkTextBuffer *buffer);
+
+// Stop following buffer. Snapshots already taken stay valid.
+void text_mirror_destroy(TextMirror *mirror);
+
+// Size of buffer text, in bytes
+gsize text_mirror_get_length(const TextMirror *mirror);
+
+// Copy of buffer text as it is now
+//   Must be called from main loop thread, as buffer.
+TextSnapshot *text_mirror_snapshot(TextMirror *mirror);
+
+// Saving only what changed
+//   A mirror may track which bytes were changed since its text was last
+//   saved, so a save can patch them in place (see io_engine_patch_file())
+//   instead of rewriting the whole file. Tracking starts with the whole
+//   text as changed, until text_mirror_set_saved() is called.
+void text_mirror_track_changes(TextMirror *mirror);
+
+// The text is now the same as file, e.g. it was just read or saved (see
+//   io_engine_read_file() and io_engine_get_file_id()). If someone else
+//   changes the file, it's no longer patched but written whole. If file is
+//   NULL, it isn't known: the whole text is taken as changed.
+void text_mirror_set_saved(TextMirror *mirror, const IoEngineFileId *file);
+
+// Snapshot for saving, with the changes it carries. Only one at a time.
+//   Call text_snapshot_set_written() once it's written, and then
+//   text_mirror_end_save(), as text may be changing.
+TextSnapshot *text_mirror_begin_save(TextMirror *mirror);
+void text_mirror_end_save(TextMirror *mirror, const TextSnapshot *snapshot,
+		gboolean written);
+
+// Soft breaks
+//   A long line may be shown split in segments (see long_lines.h) by newlines
+//   that aren't part of the text: the mirror skips them, so snapshots and
+//   saves don't have them. They're tagged as not editable, so the user can't
+//   delete them; they go away with the text around them, e.g. when the
+//   whole text is set.
+
+// Set buffer text, split by soft breaks at soft_breaks (character offsets of
+//   text, ascending, e.g. from long_lines_get_breaks()), if not NULL.
+void text_mirror_set_text(TextMirror *mirror, const gchar *text, gsize length,
+		const GArray *soft_breaks);
+
+// Stop following buffer for a while, e.g. while it shows a preview of text.
+//   Mirror keeps its text, and soft breaks are forgotten. Meanwhile,
+//   text_mirror_set_text() only sets buffer text: before thawing, use it to
+//   put mirror text back in buffer.
+void text_mirror_freeze(TextMirror *mirror);
+void text_mirror_thaw(TextMirror *mirror);
+gboolean text_mirror_is_frozen(const TextMirror *mirror);
+
+// Size of snapshot text, in bytes
+gsize text_snapshot_get_length(const TextSnapshot *snapshot);
+
+// Snapshot text in a single NUL-terminated string. Free it with g_free().
+//   Snapshot functions can be called from any thread.
+gchar *text_snapshot_flatten(const TextSnapshot *snapshot, gsize *length);
+
+// Snapshot was just written to filename: keep what the file is now
+void text_snapshot_set_written(TextSnapshot *snapshot, const gchar *filename);
+
+// Ranges of snapshot text changed since it was saved, if it's worth saving
+//   only them. Range data points into data. Free both with g_array_free()
+//   and g_free(). file is the file as it was when text was saved, to be
+//   given to io_engine_patch_file().
+//   Returns FALSE if the whole text should be written.
+gboolean text_snapshot_get_changes(const TextSnapshot *snapshot, GArray **ranges,
+		gchar **data, IoEngineFileId *file);
+
+void text_snapshot_free(TextSnapshot *snapshot);
+
+#endif // R_TEXT_SNAPSHOT_H_
@@ -0,0 +1,567 @@
+/*
+ * Copyright © 2011 Rodolfo Ribeiro Gomes <rodolforg arr0ba gmail.com>
+ *
+ * A file handler for GTK+
+ *
+    This file is part of GtkFileHandler.
+
+    GtkFileHandler is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GtkFileHandler is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GtkFileHandler.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "undo_history.h"
+
+#include <string.h>
+
+///////////////////////////////////
+// For internal use
+///////////////////////////////////
+
+// Text of edits is copied into big blocks, filled in order.
+//   As edits are forgotten oldest first, so are blocks.
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct {
+	gsize size;
+	gsize used;
+	gchar data[];
+} ArenaBlock;
+
+typedef enum {
+	RECORD_INSERT,
+	RECORD_DELETE
+} RecordType;
+
+// An edit: text inserted at or deleted from offset
+//   Records with the same group are undone/redone together.
+typedef struct {
+	RecordType type;
+	guint group;
+	gint offset;
+	gint chars;
+	ArenaBlock *block;
+	gchar *text;
+	gsize bytes;
+} UndoRecord;
+
+struct _UndoHistory {
+	GtkTextBuffer *buffer;
+	Filehandler *fh;
+	GtkAction *undo_action;
+	GtkAction *redo_action;
+
+	// Arena: ArenaBlock, oldest first
+	GQueue blocks;
+	gsize arena_size;
+
+	// Records before pos are done; from pos on, they were undone.
+	//   Those before first were already forgotten.
+	GArray *records;
+	guint first;
+	guint pos;
+	// Absolute position of records[0], as records get compacted
+	gint64 base;
+	// Absolute position where buffer was saved, -1 if it can't be reached
+	gint64 save_point;
+	// Same, for the save going on in background
+	gint64 saving_point;
+	// A save is going on in background, and no other one was done since
+	//   it started: when it ends, it's where buffer was saved
+	gboolean saving;
+
+	gsize budget;
+	guint group;
+	gint user_action_depth;
+	gint not_undoable;
+	gboolean applying;
+	gboolean can_merge;
+
+	gulong handlers[4];
+};
+
+#define RECORD(h, n) (&g_array_index((h)->records, UndoRecord, (n)))
+
+static void free_blocks(UndoHistory *history)
+{
+	ArenaBlock *block;
+	while ((block = g_queue_pop_head(&history->blocks)) != NULL)
+		g_free(block);
+	history->arena_size = 0;
+}
+
+// Get room for bytes of text on the last block, or on a new one
+static gchar *arena_alloc(UndoHistory *history, gsize bytes, ArenaBlock **block_out)
+{
+	ArenaBlock *block = g_queue_peek_tail(&history->blocks);
+
+	if (block == NULL || block->size - block->used < bytes)
+	{
+		gsize size = MAX(ARENA_BLOCK_SIZE, bytes);
+		block = g_malloc(sizeof(ArenaBlock) + size);
+		block->size = size;
+		block->used = 0;
+		g_queue_push_tail(&history->blocks, block);
+		history->arena_size += sizeof(ArenaBlock) + size;
+	}
+
+	gchar *ptr = block->data + block->used;
+	block->used += bytes;
+	*block_out = block;
+	return ptr;
+}
+
+// Free oldest blocks no live record uses anymore
+static void arena_release_head(UndoHistory *history)
+{
+	if (history->first >= history->records->len)
+	{
+		free_blocks(history);
+		return;
+	}
+
+	ArenaBlock *in_use = RECORD(history, history->first)->block;
+	ArenaBlock *block;
+	while ((block = g_queue_peek_head(&history->blocks)) != NULL && block != in_use)
+	{
+		g_queue_pop_head(&history->blocks);
+		history->arena_size -= sizeof(ArenaBlock) + block->size;
+		g_free(block);
+	}
+}
+
+// Give back the room of records dropped from the end
+static void arena_release_tail(UndoHistory *history)
+{
+	if (history->first >= history->records->len)
+	{
+		free_blocks(history);
+		return;
+	}
+
+	UndoRecord *last = RECORD(history, history->records->len - 1);
+	ArenaBlock *block;
+	while ((block = g_queue_peek_tail(&history->blocks)) != NULL && block != last->block)
+	{
+		g_queue_pop_tail(&history->blocks);
+		history->arena_size -= sizeof(ArenaBlock) + block->size;
+		g_free(block);
+	}
+	last->block->used = last->text + last->bytes - last->block->data;
+}
+
+// Drop forgotten records from the array, once they're many
+static void compact(UndoHistory *history)
+{
+	if (history->first == 0 || history->first < history->records->len / 2)
+		return;
+
+	g_array_remove_range(history->records, 0, history->first);
+	history->base += history->first;
+	history->pos -= history->first;
+	history->first = 0;
+}
+
+// Drop records that were undone
+static void drop_redo(UndoHistory *history)
+{
+	if (history->pos >= history->records->len)
+		return;
+
+	g_array_set_size(history->records, history->pos);
+	arena_release_tail(history);
+
+	if (history->save_point > history->base + history->pos)
+		history->save_point = -1;
+	if (history->saving_point > history->base + history->pos)
+		history->saving_point = -1;
+}
+
+// Forget oldest records until history fits in budget
+static void enforce_budget(UndoHistory *history)
+{
+	while (undo_history_get_size(history) > history->budget
+			&& history->first < history->records->len)
+	{
+		if (history->first < history->pos)
+			history->first++;
+		else
+			drop_redo(history);
+		arena_release_head(history);
+	}
+
+	if (history->save_point < history->base + history->first)
+		history->save_point = -1;
+	if (history->saving_point < history->base + history->first)
+		history->saving_point = -1;
+	compact(history);
+}
+
+static void update_actions(UndoHistory *history)
+{
+	if (history->undo_action != NULL)
+		gtk_action_set_sensitive(history->undo_action, undo_history_can_undo(history));
+	if (history->redo_action != NULL)
+		gtk_action_set_sensitive(history->redo_action, undo_history_can_redo(history));
+}
+
+// Try to append this edit to the last record, e.g. when user is typing
+static gboolean merge_record(UndoHistory *history, RecordType type,
+		gint offset, const gchar *text, gsize bytes, gint chars)
+{
+	if (!history->can_merge || history->pos == history->first || chars != 1)
+		return FALSE;
+	if (history->save_point == history->base + history->pos
+			|| history->saving_point == history->base + history->pos)
+		return FALSE;
+	if (*text == '\n')
+		return FALSE;
+
+	UndoRecord *last = RECORD(history, history->pos - 1);
+	if (last->type != type)
+		return FALSE;
+
+	// Backspace: it can't grow in place, but it's undone along with last one
+	if (type == RECORD_DELETE && offset + chars == last->offset)
+		return FALSE;
+
+	if (type == RECORD_INSERT && offset != last->offset + last->chars)
+		return FALSE;
+	if (type == RECORD_DELETE && offset != last->offset)
+		return FALSE;
+
+	// Text must be the last thing on arena, with room after it
+	ArenaBlock *block = last->block;
+	if (last->text + last->bytes != block->data + block->used
+			|| g_queue_peek_tail(&history->blocks) != block
+			|| block->size - block->used < bytes)
+		return FALSE;
+
+	memcpy(block->data + block->used, text, bytes);
+	block->used += bytes;
+	last->bytes += bytes;
+	last->chars += chars;
+	return TRUE;
+}
+
+static void add_record(UndoHistory *history, RecordType type,
+		gint offset, const gchar *text, gsize bytes)
+{
+	if (history->applying || history->not_undoable > 0 || bytes == 0)
+		return;
+
+	drop_redo(history);
+
+	gint chars = g_utf8_strlen(text, bytes);
+
+	if (!merge_record(history, type, offset, text, bytes, chars))
+	{
+		UndoRecord record;
+		record.type = type;
+		record.offset = offset;
+		record.chars = chars;
+		record.bytes = bytes;
+		record.text = arena_alloc(history, bytes, &record.block);
+		memcpy(record.text, text, bytes);
+
+		if (history->user_action_depth > 0)
+			record.group = history->group;
+		else
+			record.group = ++history->group;
+
+		// Consecutive backspaces are undone at once
+		if (type == RECORD_DELETE && chars == 1 && history->can_merge
+				&& history->pos > history->first && *text != '\n')
+		{
+			UndoRecord *last = RECORD(history, history->pos - 1);
+			if (last->type == RECORD_DELETE && offset + chars == last->offset
+					&& history->save_point != history->base + history->pos)
+				record.group = last->group;
+		}
+
+		g_array_append_val(history->records, record);
+		history->pos++;
+	}
+
+	history->can_merge = TRUE;
+	enforce_budget(history);
+	update_actions(history);
+}
+
+// Tell Filehandler if buffer is back to what was saved
+static void update_file_changed(UndoHistory *history)
+{
+	if (history->fh != NULL)
+		filehandler_file_changed(history->fh,
+				history->base + history->pos != history->save_point);
+}
+
+// Apply a record, forward or backward. Returns where cursor should go.
+static gint apply_record(UndoHistory *history, const UndoRecord *record, gboolean undo)
+{
+	GtkTextIter start, end;
+	gboolean insert = (record->type == RECORD_INSERT) != undo;
+
+	gtk_text_buffer_get_iter_at_offset(history->buffer, &start, record->offset);
+	if (insert)
+	{
+		gtk_text_buffer_insert(history->buffer, &start, record->text, record->bytes);
+		return record->offset + record->chars;
+	}
+
+	gtk_text_buffer_get_iter_at_offset(history->buffer, &end, record->offset + record->chars);
+	gtk_text_buffer_delete(history->buffer, &start, &end);
+	return record->offset;
+}
+
+static void place_cursor(UndoHistory *history, gint offset)
+{
+	GtkTextIter iter;
+	gtk_text_buffer_get_iter_at_offset(history->buffer, &iter, offset);
+	gtk_text_buffer_place_cursor(history->buffer, &iter);
+}
+
+///////////////////////////////////
+// Buffer signals
+///////////////////////////////////
+
+static void on_insert_text(GtkTextBuffer *buffer, GtkTextIter *location,
+		gchar *text, gint len, gpointer data)
+{
+	UndoHistory *history = data;
+	if (len < 0)
+		len = strlen(text);
+	add_record(history, RECORD_INSERT, gtk_text_iter_get_offset(location), text, len);
+}
+
+static void on_delete_range(GtkTextBuffer *buffer, GtkTextIter *start,
+		GtkTextIter *end, gpointer data)
+{
+	UndoHistory *history = data;
+	if (history->applying || history->not_undoable > 0)
+		return;
+
+	gchar *text = gtk_text_buffer_get_slice(buffer, start, end, TRUE);
+	add_record(history, RECORD_DELETE, gtk_text_iter_get_offset(start), text, strlen(text));
+	g_free(text);
+}
+
+static void on_begin_user_action(GtkTextBuffer *buffer, gpointer data)
+{
+	UndoHistory *history = data;
+	if (history->user_action_depth++ == 0)
+		history->group++;
+}
+
+static void on_end_user_action(GtkTextBuffer *buffer, gpointer data)
+{
+	UndoHistory *history = data;
+	if (history->user_action_depth > 0)
+		history->user_action_depth--;
+}
+
+///////////////////////////////////
+// Contructors & destructors
+///////////////////////////////////
+
+// Start recording edits of buffer
+UndoHistory *undo_history_new(GtkTextBuffer *buffer, Filehandler *fh)
+{
+	g_return_val_if_fail(buffer != NULL, NULL);
+
+	UndoHistory *history = g_new0(UndoHistory, 1);
+	history->buffer = g_object_ref(buffer);
+	history->fh = fh;
+	g_queue_init(&history->blocks);
+	history->records = g_array_new(FALSE, FALSE, sizeof(UndoRecord));
+	history->budget = UNDO_HISTORY_DEFAULT_BUDGET;
+	history->save_point = 0;
+	history->saving_point = -1;
+
+	history->handlers[0] = g_signal_connect(buffer, "insert-text",
+			G_CALLBACK(on_insert_text), history);
+	history->handlers[1] = g_signal_connect(buffer, "delete-range",
+			G_CALLBACK(on_delete_range), history);
+	history->handlers[2] = g_signal_connect(buffer, "begin-user-action",
+			G_CALLBACK(on_begin_user_action), history);
+	history->handlers[3] = g_signal_connect(buffer, "end-user-action",
+			G_CALLBACK(on_end_user_action), history);
+
+	return history;
+}
+
+// Stop recording and free the history
+void undo_history_destroy(UndoHistory *history)
+{
+	if (history == NULL)
+		return;
+
+	gint n;
+	for (n = 0; n < 4; n++)
+		g_signal_handler_disconnect(history->buffer, history->handlers[n]);
+	g_object_unref(history->buffer);
+
+	free_blocks(history);
+	g_array_free(history->records, TRUE);
+	g_free(history);
+}
+
+///////////////////////////////////
+// Accessors & mutators
+///////////////////////////////////
+
+void undo_history_set_budget(UndoHistory *history, gsize bytes)
+{
+	g_return_if_fail(history != NULL);
+	history->budget = bytes;
+	enforce_budget(history);
+	update_actions(history);
+}
+
+gsize undo_history_get_size(const UndoHistory *history)
+{
+	g_return_val_if_fail(history != NULL, 0);
+	return history->arena_size
+			+ (history->records->len - history->first) * sizeof(UndoRecord);
+}
+
+void undo_history_set_actions(UndoHistory *history, GtkAction *undo, GtkAction *redo)
+{
+	g_return_if_fail(history != NULL);
+	history->undo_action = undo;
+	history->redo_action = redo;
+	update_actions(history);
+}
+
+gboolean undo_history_can_undo(const UndoHistory *history)
+{
+	return history != NULL && history->pos > history->first;
+}
+
+gboolean undo_history_can_redo(const UndoHistory *history)
+{
+	return history != NULL && history->pos < history->records->len;
+}
+
+// Forget every step
+void undo_history_clear(UndoHistory *history)
+{
+	g_return_if_fail(history != NULL);
+
+	g_array_set_size(history->records, 0);
+	free_blocks(history);
+	history->base += history->pos;
+	history->first = history->pos = 0;
+	history->save_point = -1;
+	history->saving_point = -1;
+	history->saving = FALSE;
+	history->can_merge = FALSE;
+	update_actions(history);
+}
+
+void undo_history_begin_not_undoable(UndoHistory *history)
+{
+	g_return_if_fail(history != NULL);
+	history->not_undoable++;
+}
+
+// History is cleared, and the text is taken as the saved one
+void undo_history_end_not_undoable(UndoHistory *history)
+{
+	g_return_if_fail(history != NULL && history->not_undoable > 0);
+	if (--history->not_undoable > 0)
+		return;
+
+	undo_history_clear(history);
+	undo_history_set_save_point(history);
+}
+
+// Tell history the buffer has just been saved
+void undo_history_set_save_point(UndoHistory *history)
+{
+	g_return_if_fail(history != NULL);
+	history->save_point = history->base + history->pos;
+	// A save going on in background is older than this one
+	history->saving = FALSE;
+	history->can_merge = FALSE;
+}
+
+void undo_history_begin_save(UndoHistory *history)
+{
+	g_return_if_fail(history != NULL);
+	history->saving_point = history->base + history->pos;
+	history->saving = TRUE;
+}
+
+void undo_history_end_save(UndoHistory *history, gboolean written)
+{
+	g_return_if_fail(history != NULL);
+	// Saved as something else meanwhile?
+	if (written && history->saving)
+		history->save_point = history->saving_point;
+	history->saving_point = -1;
+	history->saving = FALSE;
+}
+
+///////////////////////////////////
+// Undo & redo
+///////////////////////////////////
+
+gboolean undo_history_undo(UndoHistory *history)
+{
+	if (!undo_history_can_undo(history))
+		return FALSE;
+
+	guint group = RECORD(history, history->pos - 1)->group;
+	gint cursor = 0;
+
+	history->applying = TRUE;
+	gtk_text_buffer_begin_user_action(history->buffer);
+	while (history->pos > history->first && RECORD(history, history->pos - 1)->group == group)
+	{
+		cursor = apply_record(history, RECORD(history, history->pos - 1), TRUE);
+		history->pos--;
+	}
+	gtk_text_buffer_end_user_action(history->buffer);
+	history->applying = FALSE;
+
+	place_cursor(history, cursor);
+	history->can_merge = FALSE;
+	update_file_changed(history);
+	update_actions(history);
+	return TRUE;
+}
+
+gboolean undo_history_redo(UndoHistory *history)
+{
+	if (!undo_history_can_redo(history))
+		return FALSE;
+
+	guint group = RECORD(history, history->pos)->group;
+	gint cursor = 0;
+
+	history->applying = TRUE;
+	gtk_text_buffer_begin_user_action(history->buffer);
+	while (history->pos < history->records->len && RECORD(history, history->pos)->group == group)
+	{
+		cursor = apply_record(history, RECORD(history, history->pos), FALSE);
+		history->pos++;
+	}
+	gtk_text_buffer_end_user_action(history->buffer);
+	history->applying = FALSE;
+
+	place_cursor(history, cursor);
+	history->can_merge = FALSE;
+	update_file_changed(history);
+	update_actions(history);
+	return TRUE;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright © 2011 Rodolfo Ribeiro Gomes <rodolforg arr0ba gmail.com>
+ *
+ * A file handler for GTK+
+ *
+    This file is part of GtkFileHandler.
+
+    GtkFileHandler is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GtkFileHandler is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GtkFileHandler.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef R_UNDO_HISTORY_H_
+#define R_UNDO_HISTORY_H_
+
+#include "gtk/gtk.h"
+
+#include "filehandler.h"
+
+// Undo/redo history of a GtkTextBuffer
+//   It records only what was inserted or deleted, never a copy of the whole
+//   text. Consecutive typing becomes a single step. When history grows
+//   beyond its memory budget, oldest steps are forgotten.
+typedef struct _UndoHistory UndoHistory;
+
+// Default memory budget of a history, in bytes
+#define UNDO_HISTORY_DEFAULT_BUDGET (4 * 1024 * 1024)
+
+// Start recording edits of buffer
+//   If fh is not NULL, undoing/redoing back to the point the file was saved
+//   tells Filehandler there are no changes anymore.
+UndoHistory *undo_history_new(GtkTextBuffer *buffer, Filehandler *fh);
+
+// Stop recording and free the history
+void undo_history_destroy(UndoHistory *history);
+
+// Set the memory budget, in bytes
+//   Oldest steps are dropped at once if it's already exceeded.
+void undo_history_set_budget(UndoHistory *history, gsize bytes);
+
+// Approximated memory used by the history, in bytes
+gsize undo_history_get_size(const UndoHistory *history);
+
+// GtkActions which have their sensitiveness set properly. May be NULL.
+void undo_history_set_actions(UndoHistory *history, GtkAction *undo, GtkAction *redo);
+
+gboolean undo_history_can_undo(const UndoHistory *history);
+gboolean undo_history_can_redo(const UndoHistory *history);
+
+// Undo/redo one step. Returns FALSE if there was nothing to do.
+gboolean undo_history_undo(UndoHistory *history);
+gboolean undo_history_redo(UndoHistory *history);
+
+// Forget every step
+void undo_history_clear(UndoHistory *history);
+
+// Edits between these calls aren't recorded, and history is cleared,
+//   e.g., when the whole text is replaced by the contents of a file.
+void undo_history_begin_not_undoable(UndoHistory *history);
+void undo_history_end_not_undoable(UndoHistory *history);
+
+// Tell history the buffer has just been saved
+void undo_history_set_save_point(UndoHistory *history);
+
+// For saves done in background: the buffer, as it is now, is being saved,
+//   while editing goes on. When it's done, if it was written, that becomes
+//   the save point (if history can still reach it), unless the buffer was
+//   saved otherwise meanwhile.
+void undo_history_begin_save(UndoHistory *history);
+void undo_history_end_save(UndoHistory *history, gboolean written);
+
+#endif // R_UNDO_HISTORY_H_